@@ -0,0 +1,67 @@
+/* ppbench: time ppr() against snprintf() for the kind of lines the
+ * allocator traces print.  Both sides batch into the same size buffer
+ * and write to /dev/null, so the difference is the formatting.
+ *
+ *   make bench && ./ppbench [records]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include "pp.h"
+
+#define BATCH 768               /* matches ppr()'s default flush point */
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  long n = argc > 1 ? strtol(argv[1], NULL, 10) : 2000000;
+  int fd = open("/dev/null", O_WRONLY);
+  char buf[BATCH + 128];
+  int off = 0;
+  long i;
+  double t0, t_pp, t_sn;
+  unsigned long x = 0x7f3a12c45e10UL;
+
+  if ( fd < 0 ) {
+    perror("/dev/null");
+    return 1;
+  }
+
+  t0 = now();
+  for ( i = 0; i < n; i++ ) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    ppr(fd, "MALLOC: malloc(%zu) => (ptr=%p, size=%zu)\n",
+        (size_t)(x >> 52), (void *)(x >> 16), (size_t)(x >> 40));
+  }
+  ppflush();
+  t_pp = now() - t0;
+
+  t0 = now();
+  for ( i = 0; i < n; i++ ) {
+    x = x * 6364136223846793005UL + 1442695040888963407UL;
+    off += snprintf(buf + off, sizeof(buf) - off,
+                    "MALLOC: malloc(%zu) => (ptr=%p, size=%zu)\n",
+                    (size_t)(x >> 52), (void *)(x >> 16), (size_t)(x >> 40));
+    if ( off >= BATCH ) {
+      if ( write(fd, buf, off) < 0 )
+        perror("write");
+      off = 0;
+    }
+  }
+  if ( off && write(fd, buf, off) < 0 )
+    perror("write");
+  t_sn = now() - t0;
+
+  printf("%ld records\n", n);
+  printf("  ppr      %7.1f ns/record\n", t_pp * 1e9 / n);
+  printf("  snprintf %7.1f ns/record\n", t_sn * 1e9 / n);
+  close(fd);
+  return 0;
+}
@@ -4,6 +4,8 @@
 #include <stdio.h>
 
 void pp(FILE *where, char *fmt,...);
+void ppr(int fd, char *fmt,...);
+void ppflush(void);
 
 #endif
 
@@ -3,12 +3,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
 #include "pb.h"
 
 void pbreset(struct pbuff *pb) {
   /* reset the given buffer to empty */
   pb->idx=0;
+  pb->ahead=NULL;
 }
 
 void pbputc(int c, struct pbuff *pb) {
@@ -19,18 +23,75 @@ void pbputc(int c, struct pbuff *pb) {
 }
 
 void pbflush(struct pbuff *pb) {
-  /* flush the given buffer */
-  if ( -1 == write(pb->fd, pb->buff, pb->idx) ) {
-    perror("pbflush:write");
-    exit(EXIT_FAILURE);         /* something went terribly wrong */
+  /* flush the given buffer.  If another buffer is queued ahead of
+   * this one, both go out in a single writev() so they can't be
+   * split apart by some other writer on the same fd. */
+  struct iovec iov[2];
+  int n = 0, i;
+  ssize_t done;
+
+  if ( pb->ahead && pb->ahead->idx ) {
+    iov[n].iov_base = pb->ahead->buff;
+    iov[n++].iov_len = pb->ahead->idx;
+  }
+  if ( pb->idx ) {
+    iov[n].iov_base = pb->buff;
+    iov[n++].iov_len = pb->idx;
+  }
+  for ( i = 0; i < n; ) {       /* writev() may come up short */
+    done = writev(pb->fd, iov + i, n - i);
+    if ( done == -1 ) {
+      if ( errno == EINTR )
+        continue;
+      perror("pbflush:writev");
+      exit(EXIT_FAILURE);       /* something went terribly wrong */
+    }
+    while ( i < n && (size_t)done >= iov[i].iov_len )
+      done -= iov[i++].iov_len;
+    if ( i < n ) {
+      iov[i].iov_base = (char *)iov[i].iov_base + done;
+      iov[i].iov_len -= done;
+    }
   }
-  pbreset(pb);
+  if ( pb->ahead )
+    pb->ahead->idx = 0;
+  pb->idx = 0;
 }
 
 void pbputs(const char *s, struct pbuff *pb) {
   /* write the given string to the given buffer */
-  while (*s)
-    pbputc(*s++,pb);
+  pbwrite(s, strlen(s), pb);
+}
+
+void pbwrite(const char *s, int len, struct pbuff *pb) {
+  /* copy len bytes into the given buffer, a buffer-full at a time */
+  int n;
+  while ( len > 0 ) {
+    if ( pb->idx == PBSIZE )
+      pbflush(pb);
+    n = PBSIZE - pb->idx;
+    if ( n > len )
+      n = len;
+    memcpy(pb->buff + pb->idx, s, n);
+    pb->idx += n;
+    s += n;
+    len -= n;
+  }
+}
+
+void pbfill(int c, int n, struct pbuff *pb) {
+  /* add n copies of c to the given buffer */
+  int k;
+  while ( n > 0 ) {
+    if ( pb->idx == PBSIZE )
+      pbflush(pb);
+    k = PBSIZE - pb->idx;
+    if ( k > n )
+      k = n;
+    memset(pb->buff + pb->idx, c, k);
+    pb->idx += k;
+    n -= k;
+  }
 }
 
 #ifdef  TESTMAIN
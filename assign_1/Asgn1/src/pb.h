@@ -8,12 +8,15 @@
 struct pbuff {
   int fd;                       /* where to write() */
   int idx;                      /* where are we in this thing */
+  struct pbuff *ahead;          /* written out before us, or NULL */
   char buff[PBSIZE];            /* the buffer */
 };
 
 void pbreset(struct pbuff *pb);
 void pbputc(int c, struct pbuff *pb);
 void pbputs(const char *s, struct pbuff *pb);
+void pbwrite(const char *s, int len, struct pbuff *pb);
+void pbfill(int c, int n, struct pbuff *pb);
 void pbflush(struct pbuff *pb);
 
 #endif
@@ -4,57 +4,184 @@
 #include<stdlib.h>
 #include<unistd.h>
 #include<ctype.h>
+#include<time.h>
+#include<pthread.h>
 #include "pb.h"
+#include "pp.h"
 
-static const char *dtos(long num, int us, int radix) {
-  /* convert to a string in the given radix, signed or unsigned
-   * depending on us */
-  #define SIZE (sizeof(long)*8 + 2) /* Big enough for binary */
-  const char digit[]="0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-  static char b[SIZE], *s;
-  int neg;
-  unsigned long pos;             /* be positive */
+/* ppr() batches per thread and flushes when either this many bytes are
+ * waiting or the oldest waiting byte is this old (checked on each call).
+ */
+#ifndef PP_FLUSH_BYTES
+#define PP_FLUSH_BYTES (PBSIZE*3/4)
+#endif
+#ifndef PP_FLUSH_NSEC
+#define PP_FLUSH_NSEC (100*1000*1000LL)
+#endif
 
-  if ( radix < 2 || radix > 36 )
-    return "bad radix";
+#define SIZE (sizeof(long)*8 + 2) /* Big enough for any number we print */
 
-  if ( num == 0 )
-    return "0";
+/* "00".."99" so decimal conversion does one divide per two digits */
+static const char digits2[] =
+  "00010203040506070809" "10111213141516171819"
+  "20212223242526272829" "30313233343536373839"
+  "40414243444546474849" "50515253545556575859"
+  "60616263646566676869" "70717273747576777879"
+  "80818283848586878889" "90919293949596979899";
+static const char xdigit[] = "0123456789ABCDEF";
+static const unsigned long long pow10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+  10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+  100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+  100000000000000000ULL, 1000000000000000000ULL,
+  10000000000000000000ULL
+};
 
-  /* this arithmetic only works on non-negative numbers */
-  neg = (num < 0) && !us;
-  if ( neg )
-    pos = -num;
+#define LBITS ((int)(sizeof(long)*8))
+
+static int declen(unsigned long u) {
+  /* decimal digits in u: bit length times log10(2) (~1233/4096) is
+   * either right or one too big, and one table compare settles it */
+  int t = (LBITS - __builtin_clzl(u | 1)) * 1233 >> 12;
+  return t + 1 - (u < pow10[t] && t);
+}
+
+static int hexlen(unsigned long u) {
+  /* hex digits in u, straight from the bit length */
+  return (LBITS - __builtin_clzl(u | 1) + 3) >> 2;
+}
+
+static void putdec(char *end, unsigned long u) {
+  /* write u so its last digit lands just before end */
+  unsigned long r;
+  while ( u >= 100 ) {
+    r = u % 100;
+    u /= 100;
+    end -= 2;
+    memcpy(end, digits2 + 2*r, 2);
+  }
+  if ( u >= 10 )
+    memcpy(end - 2, digits2 + 2*u, 2);
   else
-    pos = num;
+    end[-1] = '0' + u;
+}
 
-  s = b+SIZE-1;
-  *s = '\0';
-  while (pos) {
-    *--s=digit[pos%radix];
-    pos /= radix;
+static void puthex(char *end, unsigned long u, int n) {
+  /* write the low n nibbles of u so the last lands just before end */
+  while ( n-- ) {
+    *--end = xdigit[u & 0xF];
+    u >>= 4;
   }
+}
+
+static void putnum(unsigned long u, int neg, int hex, int wid, int zpad,
+                   struct pbuff *pb) {
+  /* print u (with a '-' if neg) right justified in a field wid wide.
+   * The digits go straight into pb when there's room, otherwise they
+   * are built on the stack and copied in. */
+  char tmp[SIZE], *d;
+  int len = hex ? hexlen(u) : declen(u);
+  int fill = wid - len - neg;
+
+  if ( fill > 0 && !zpad )
+    pbfill(' ', fill, pb);
   if ( neg )
-    *--s='-';
+    pbputc('-', pb);
+  if ( fill > 0 && zpad )
+    pbfill('0', fill, pb);
 
-  return s;
+  d = (PBSIZE - pb->idx >= len) ? pb->buff + pb->idx : tmp;
+  if ( hex )
+    puthex(d + len, u, len);
+  else
+    putdec(d + len, u);
+  if ( d == tmp )
+    pbwrite(tmp, len, pb);
+  else
+    pb->idx += len;
 }
 
 static void padputs(const char *s, int wid, int zpad, struct pbuff *pb){
   /* print the given string right justified in a field wid wide */
-  int i;
-  for( i = wid - strlen(s); i>0; i--)
-    pbputc(zpad?'0':' ',pb);
-  pbputs(s,pb);
+  int len = strlen(s);
+  if ( wid > len )
+    pbfill(zpad?'0':' ', wid - len, pb);
+  pbwrite(s, len, pb);
 }
 
-void pp(FILE *where, char *fmt,...) {
-  /* will fail for max negative number.  Oh, well */
-  va_list ap;
-  long l;
+static void ppfmt(struct pbuff *pb, char *fmt, va_list ap) {
+  /* format into pb */
+  int l;
   char c;
   int pad=0,zpad=0;
-  char *s;
+  long n;
+  unsigned long u;
+  char *s, *lit;
+
+  for(s=fmt;*s;s++) {
+    if ( *s != '%' ) {          /* copy literal runs in one go */
+      for ( lit = s; s[1] && s[1] != '%'; s++ )
+        ;
+      pbwrite(lit, s - lit + 1, pb);
+      continue;
+    }
+    pad=zpad=l=0;
+    c = *++s;
+    if ( c == 'l' || c == 'z' ) { /* check for long (before the width) */
+      l = 1;
+      c = *++s;
+    }
+    if ( isdigit(c) ) {         /* check for field width */
+      if ( c == '0' )
+        zpad=1;
+      pad = strtol(s,&s,10);/* translate number and advance to just past */
+      c = *s;               /* if it's the nul, it'll be caught below */
+    }
+    if ( c == 'l' || c == 'z' ) { /* or after it, like printf */
+      l = 1;
+      c = *++s;
+    }
+    switch (c) {
+    case '%':
+      pbputc(*s,pb);
+      break;
+    case 'c':
+      pbputc(va_arg(ap,int), pb);
+      break;
+    case 'd':
+      n = l ? va_arg(ap,long) : va_arg(ap,int);
+      u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+      putnum(u, n < 0, 0, pad, zpad, pb);
+      break;
+    case 'u':
+      u = l ? va_arg(ap,unsigned long) : va_arg(ap,unsigned int);
+      putnum(u, 0, 0, pad, zpad, pb);
+      break;
+    case 'p':
+      pbwrite("0x", 2, pb);
+      l = 1;  /* pointers are longs */
+    case 'x': /* fall through */
+      u = l ? va_arg(ap,unsigned long) : va_arg(ap,unsigned int);
+      putnum(u, 0, 1, pad, zpad, pb);
+      break;
+    case 's':
+      padputs(va_arg(ap,char*), pad, zpad,pb);
+      break;
+    case '\0':                  /* fmt ended mid-conversion */
+      s--;
+      break;
+    default:
+      pbputs("<Unknown conversion:",pb);
+      pbputc(*s,pb);
+      pbputs(">",pb);
+      break;
+    }
+  }
+}
+
+void pp(FILE *where, char *fmt,...) {
+  va_list ap;
   struct pbuff pb;
 
   fflush(NULL);                 /* clear all stdio buffers */
@@ -62,57 +189,92 @@ void pp(FILE *where, char *fmt,...) {
   pb.fd = fileno(where);
 
   va_start(ap,fmt);
-  for(s=fmt;*s;s++) {
-    pad=zpad=0;
-    if ( *s == '%' ) {
-      l=0;
-      if ( (c = *++s) == 'l' ) {  /* check for long */
-        l = 1;
-        c = *++s;
-      }
-      if ( isdigit(*s) ) {  /* check for field width */
-        if ( *s == '0' )
-          zpad=1;
-        pad = strtol(s,&s,10);/* translate number and advance to just past */
-        c = *s;               /* if it's the nul, it'll be caught below */
-      }
-      switch (c) {
-      case '%':
-        pbputc(*s,&pb);
-        break;
-      case 'c':
-        pbputc(va_arg(ap,int), &pb);
-        break;
-      case 'd':
-        if ( l )
-          padputs(dtos(va_arg(ap,long), 0, 10), pad, zpad, &pb);
-        else
-          padputs(dtos(va_arg(ap,int), 0, 10),  pad, zpad, &pb);
-        break;
-      case 'p':
-        pbputs("0x",&pb);
-        l = 1;  /* pointers are longs */
-      case 'x': /* fall through */
-        if ( l )
-          padputs(dtos(va_arg(ap,long), 1, 16), pad, zpad, &pb);
-        else
-          padputs(dtos(va_arg(ap,int), 1, 16), pad, zpad, &pb);
-        break;
-      case 's':
-        padputs(va_arg(ap,char*), pad, zpad,&pb);
-        break;
-      default:
-        pbputs("<Unknown conversion:",&pb);
-        pbputc(*s,&pb);
-        pbputs(">",&pb);
-        break;
-      }
-    } else {
-      pbputc(*s,&pb);
-    }
-  }
+  ppfmt(&pb, fmt, ap);
   va_end(ap);
   pbflush(&pb);  /* Flush our buffer */
+}
+
+/* Per-thread batch for ppr().  The key only exists so the batch gets
+ * flushed when its thread exits; atexit() covers the main thread.
+ * Everything lives in one struct so a call only looks up TLS once.
+ */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define PP_CLOCK CLOCK_MONOTONIC_COARSE /* ms resolution is plenty here */
+#else
+#define PP_CLOCK CLOCK_MONOTONIC
+#endif
+
+struct ppbatch {
+  struct pbuff pb;
+  int live;
+  long long since;              /* ns timestamp of the oldest byte */
+};
+
+static __thread struct ppbatch batch;
+static pthread_key_t batch_key;
+static pthread_once_t batch_once = PTHREAD_ONCE_INIT;
+
+static void batch_exit(void *b) {
+  if ( ((struct pbuff *)b)->idx )
+    pbflush((struct pbuff *)b);
+}
+
+static void batch_init(void) {
+  pthread_key_create(&batch_key, batch_exit);
+  atexit(ppflush);
+}
 
+static long long ppclock(void) {
+  struct timespec ts;
+  clock_gettime(PP_CLOCK, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
+void ppflush(void) {
+  /* push out whatever this thread has batched */
+  if ( batch.live && batch.pb.idx )
+    pbflush(&batch.pb);
+}
+
+void ppr(int fd, char *fmt,...) {
+  /* Like pp(), but reentrant and batched.  Never touches stdio.  Each
+   * call is formatted into its own record so a record is never split
+   * between two writes unless it's bigger than a whole buffer. */
+  va_list ap;
+  struct pbuff rec;
+  struct ppbatch *b = &batch;
+  long long now;
+
+  if ( !b->live ) {
+    pthread_once(&batch_once, batch_init);
+    pbreset(&b->pb);
+    b->pb.fd = fd;
+    pthread_setspecific(batch_key, &b->pb);
+    b->live = 1;
+  }
+  if ( b->pb.fd != fd ) {       /* one fd per batch */
+    ppflush();
+    b->pb.fd = fd;
+  }
+
+  pbreset(&rec);
+  rec.fd = fd;
+  rec.ahead = &b->pb;
+  va_start(ap,fmt);
+  ppfmt(&rec, fmt, ap);
+  va_end(ap);
+
+  now = ppclock();
+  if ( b->pb.idx + rec.idx <= PBSIZE ) {
+    if ( !b->pb.idx )
+      b->since = now;
+    memcpy(b->pb.buff + b->pb.idx, rec.buff, rec.idx);
+    b->pb.idx += rec.idx;
+  } else {
+    pbflush(&rec);              /* batch and record in one writev() */
+  }
+
+  if ( b->pb.idx >= PP_FLUSH_BYTES ||
+       (b->pb.idx && now - b->since >= PP_FLUSH_NSEC) )
+    pbflush(&b->pb);
+}
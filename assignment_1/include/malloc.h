@@ -0,0 +1,39 @@
+/* malloc.h — public interface for the custom allocator
+ *
+ * Declares the standard malloc-family symbols plus the allocator's own
+ * extensions. Make sure this directory comes before the system include
+ * path if you also use <malloc.h>.  */
+
+#ifndef CUSTOM_MALLOC_H_
+#define CUSTOM_MALLOC_H_
+
+#include <stddef.h> /* size_t */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+    void *malloc(size_t size);
+    void free(void *ptr);
+    void *realloc(void *ptr, size_t size);
+    void *calloc(size_t nmemb, size_t size);
+
+    /* Touch every page of the reservation up front so the first
+     * allocations don't take page faults. */
+#define MALLOC_RESERVE_PREFAULT 0x1
+
+    /* Grow the heap by at least `bytes` in a single step and leave it
+     * as one free block, so early allocations are served without going
+     * back to sbrk(). Returns 0 on success, -1 if the heap can't grow.
+     * The same thing happens at the first malloc() when MALLOC_RESERVE
+     * is set (e.g. MALLOC_RESERVE=64M); MALLOC_PREFAULT=1 adds
+     * MALLOC_RESERVE_PREFAULT.
+     */
+    int malloc_reserve(size_t bytes, int flags);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* CUSTOM_MALLOC_H_ */
@@ -3,7 +3,7 @@
 // "malloc" resolves to your implementation.
 //
 // Build example:
-//   gcc -Wall -Wextra -g -o test main.c malloc.c
+//   gcc -Wall -Wextra -g -Iinclude -o test main.c malloc.c
 // Run:
 //   DEBUG_MALLOC=1 ./test   (if you want your allocator's debug prints)
 
@@ -13,6 +13,7 @@
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include "malloc.h"
 
 #ifndef ALIGNMENT
 #define ALIGNMENT 16
@@ -78,6 +79,41 @@ static void test_zero_size(void) {
     check(p == NULL, "malloc(0) returns NULL");
 }
 
+static void test_sampled_guard(void) {
+    // Only meaningful with MALLOC_SAMPLE_RATE=1 in the environment:
+    // every small block should end exactly on a page boundary.
+    const char *v = getenv("MALLOC_SAMPLE_RATE");
+    if (!v || strcmp(v, "1") != 0) return;
+
+    long pg = sysconf(_SC_PAGESIZE);
+    void *p = malloc(48);
+    check(p != NULL, "sampled malloc(48)");
+    if (!p) return;
+    check(((uintptr_t)p + 48) % (uintptr_t)pg == 0,
+          "sampled block is flush against its guard page");
+    memset(p, 0x5A, 48);
+
+    void *q = realloc(p, 96);
+    check(q != NULL && ((unsigned char *)q)[47] == 0x5A,
+          "realloc of sampled block keeps its contents");
+    free(q);
+}
+
+static void test_reserve(void) {
+    // After reserving 1 MiB, 256 x 1 KiB allocations shouldn't move the break.
+    check(malloc_reserve(1 << 20, MALLOC_RESERVE_PREFAULT) == 0,
+          "malloc_reserve(1 MiB, PREFAULT)");
+    void *brk0 = sbrk(0);
+    void *blocks[256];
+    for (int i = 0; i < 256; ++i) {
+        blocks[i] = malloc(1024);
+    }
+    check(sbrk(0) == brk0, "allocations after malloc_reserve() don't grow the heap");
+    for (int i = 0; i < 256; ++i) {
+        free(blocks[i]);
+    }
+}
+
 int main(void)
 {
     dprintf(2, "\n===== custom malloc() smoke tests =====\n");
@@ -88,6 +124,8 @@ int main(void)
     test_zero_size();
     test_small_sequence();
     test_large_blocks();
+    test_sampled_guard();
+    test_reserve();
 
     dprintf(2, "=======================================\n");
     dprintf(2, "Tests run: %d, failures: %d\n", tests_run, tests_fail);
@@ -14,6 +14,9 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include "malloc.h"
 /**
  * @struct header_t
  * @brief This struct defines what is in the header of the chunk
@@ -43,6 +46,40 @@ header_t *heap_tail = NULL;
 #define PAYLOAD_FROM_HDR(h)  ((void *)((char *)(h) + HDR_SIZE))
 #define HDR_FROM_PAYLOAD(p)  ((header_t *)((char *)(p) - HDR_SIZE))
 
+/**
+ * @brief Sampled guard-page allocations
+ *
+ * With MALLOC_SAMPLE_RATE=N set, roughly one in N allocations that fit in
+ * a page is served from the guard pool instead of the heap. Each slot is a
+ * data page followed by a PROT_NONE guard page, and the payload sits as close
+ * to the guard as its alignment lets it. Like GWP-ASan, that alignment is the
+ * size rounded up to a power of two, capped at 16: a block ends flush with
+ * the guard if its size is a multiple of that, and otherwise up to 15 bytes
+ * short, where an overrun goes unnoticed.
+ * Freed slots go back to PROT_NONE and are reused oldest-first, which keeps
+ * them quarantined for as long as possible to catch use-after-free.
+ */
+#define GUARD_SLOTS 256
+
+typedef struct guard_slot{
+    bool is_used;
+    size_t size;              /* requested size                  */
+    char *payload;            /* pointer handed back to the caller */
+} guard_slot_t;
+
+static int sample_state = -1;       /* -1 unread, 0 off, 1 on */
+static size_t sample_rate = 0;
+static size_t sample_countdown = 0;
+static uint64_t sample_seed = 0x9E3779B97F4A7C15ULL;
+
+static char *guard_pool = NULL;
+static size_t guard_page = 0;
+static guard_slot_t guard_slots[GUARD_SLOTS];
+static size_t guard_fifo[GUARD_SLOTS];   /* free slots, oldest first */
+static size_t guard_fifo_head = 0;
+static size_t guard_fifo_len = 0;
+static struct sigaction guard_prev_segv;  /* handler we chain to */
+
 
 /**
  * @brief function declarations
@@ -52,6 +89,11 @@ void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
 header_t *new_page(void);
+header_t *grow_heap(size_t min_payload);
+static void *guard_alloc(size_t size);
+static bool guard_owns(const void *ptr);
+static void guard_free(void *ptr);
+static size_t guard_size(const void *ptr);
 
 
 
@@ -91,6 +133,12 @@ static inline size_t ceil_div(size_t x, size_t y) {
 static inline size_t round_up(size_t x, size_t m) {
     return ceil_div(x, m) * m;     // round x up to multiple of m
 }
+static inline size_t next_pow2(size_t x) {
+    size_t p = 1;
+    while (p < x)
+        p <<= 1;                   // smallest power of two >= x
+    return p;
+}
 
 /**
  * @brief Uses vsnprintf() for debug printing
@@ -118,6 +166,174 @@ void log_msg(const char *str, ...)
     }
 }
 
+/**
+ * @brief Draws the gap until the next sampled allocation
+ * Uniform on [1, 2N-1] so the average rate is N but the pattern isn't
+ * predictable from the allocation sequence.
+ */
+static size_t next_sample_gap(void)
+{
+    sample_seed ^= sample_seed << 13;
+    sample_seed ^= sample_seed >> 7;
+    sample_seed ^= sample_seed << 17;
+    return 1 + (size_t)(sample_seed % (2 * sample_rate - 1));
+}
+
+/**
+ * @brief Reports faults that land in the guard pool, then re-faults
+ * with the default action so the process still dies with SIGSEGV.
+ * Anything else goes to whatever handler the program had before us.
+ */
+static void guard_fault(int sig, siginfo_t *info, void *uctx)
+{
+    char *addr = (char *)info->si_addr;
+    if (!guard_pool || addr < guard_pool ||
+        addr >= guard_pool + GUARD_SLOTS * 2 * guard_page)
+    {
+        if (guard_prev_segv.sa_flags & SA_SIGINFO)
+        {
+            guard_prev_segv.sa_sigaction(sig, info, uctx);
+        }
+        else if (guard_prev_segv.sa_handler != SIG_DFL &&
+                 guard_prev_segv.sa_handler != SIG_IGN)
+        {
+            guard_prev_segv.sa_handler(sig);
+        }
+        else
+        {
+            /* Put it back and let the access fault again under it */
+            sigaction(SIGSEGV, &guard_prev_segv, NULL);
+        }
+        return;
+    }
+
+    size_t off = (size_t)(addr - guard_pool);
+    guard_slot_t *slot = &guard_slots[off / (2 * guard_page)];
+    const char *what = (off % (2 * guard_page)) >= guard_page ?
+        "buffer overflow into guard page" : "use after free";
+    char buf[160];
+    int n = snprintf(buf, sizeof(buf),
+        "MALLOC: %s at %p (block %p, size %zu)\n",
+        what, (void *)addr, (void *)slot->payload, slot->size);
+    if (n > 0)
+    {
+        write(STDERR_FILENO, buf, (size_t)n < sizeof(buf) ?
+              (size_t)n : sizeof(buf) - 1);
+    }
+    signal(sig, SIG_DFL);   /* returning re-runs the access and dies */
+}
+
+/**
+ * @brief Reads MALLOC_SAMPLE_RATE and reserves the guard pool
+ * The whole pool starts out PROT_NONE; slots are opened one at a time.
+ */
+static void sample_init(void)
+{
+    sample_state = 0;
+    const char *v = getenv("MALLOC_SAMPLE_RATE");
+    if (!v || !*v)
+        return;
+    sample_rate = (size_t)strtoul(v, NULL, 10);
+    if (sample_rate == 0)
+        return;
+
+    guard_page = (size_t)sysconf(_SC_PAGESIZE);
+    void *pool = mmap(NULL, GUARD_SLOTS * 2 * guard_page, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED)
+    {
+        log_msg("MALLOC: guard pool mmap failed, sampling disabled\n");
+        return;
+    }
+    guard_pool = (char *)pool;
+    for (size_t i = 0; i < GUARD_SLOTS; i++)
+    {
+        guard_fifo[i] = i;
+    }
+    guard_fifo_len = GUARD_SLOTS;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = guard_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &sa, &guard_prev_segv);
+
+    sample_seed ^= (uint64_t)(uintptr_t)pool;
+    sample_countdown = next_sample_gap();
+    sample_state = 1;
+}
+
+/**
+ * @brief Takes the oldest free slot and places the payload as near the
+ * guard page as its alignment allows. Returns NULL when this allocation isn't
+ * sampled so the caller falls through to the heap.
+ */
+static void *guard_alloc(size_t size)
+{
+    if (sample_state < 0)
+        sample_init();
+    if (sample_state == 0 || --sample_countdown != 0)
+        return NULL;
+    sample_countdown = next_sample_gap();
+
+    if (size > guard_page || guard_fifo_len == 0)
+        return NULL;
+
+    size_t idx = guard_fifo[guard_fifo_head];
+    char *data = guard_pool + idx * 2 * guard_page;
+    if (mprotect(data, guard_page, PROT_READ | PROT_WRITE) != 0)
+        return NULL;
+    guard_fifo_head = (guard_fifo_head + 1) % GUARD_SLOTS;
+    guard_fifo_len--;
+
+    guard_slot_t *slot = &guard_slots[idx];
+    slot->is_used = true;
+    slot->size = size;
+    size_t align = next_pow2(size) < ALIGNMENT ? next_pow2(size) : ALIGNMENT;
+    slot->payload = data + guard_page - round_up(size, align);
+    return slot->payload;
+}
+
+/**
+ * @brief Checks if the pointer came from the guard pool
+ */
+static bool guard_owns(const void *ptr)
+{
+    const char *p = (const char *)ptr;
+    return guard_pool && p >= guard_pool &&
+           p < guard_pool + GUARD_SLOTS * 2 * guard_page;
+}
+
+/**
+ * @brief Requested size of a live sampled block, 0 if it isn't live
+ */
+static size_t guard_size(const void *ptr)
+{
+    size_t idx = (size_t)((const char *)ptr - guard_pool) / (2 * guard_page);
+    guard_slot_t *slot = &guard_slots[idx];
+    return (slot->is_used && slot->payload == ptr) ? slot->size : 0;
+}
+
+/**
+ * @brief Locks the slot back down and queues it behind every other
+ * free slot (the quarantine)
+ */
+static void guard_free(void *ptr)
+{
+    size_t idx = (size_t)((char *)ptr - guard_pool) / (2 * guard_page);
+    guard_slot_t *slot = &guard_slots[idx];
+    if (!slot->is_used || slot->payload != ptr)
+    {
+        log_msg("MALLOC: free(%p) invalid or double free of sampled block\n",
+                ptr);
+        return;
+    }
+    mprotect(guard_pool + idx * 2 * guard_page, guard_page, PROT_NONE);
+    slot->is_used = false;
+    guard_fifo[(guard_fifo_head + guard_fifo_len) % GUARD_SLOTS] = idx;
+    guard_fifo_len++;
+}
+
 /**
  * @brief Split chunk
  * This function 
@@ -214,6 +430,81 @@ header_t *grow_heap(size_t min_payload)
     return new_hdr;
 }
 
+/**
+ * @brief Faults in every page of [base, base + len)
+ * Prefers MADV_POPULATE_WRITE, falls back to writing a byte per page.
+ */
+static void prefault(char *base, size_t len)
+{
+#ifdef MADV_POPULATE_WRITE
+    uintptr_t pg = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)base & ~(pg - 1);
+    if (madvise((void *)start, (uintptr_t)base + len - start,
+                MADV_POPULATE_WRITE) == 0)
+    {
+        return;
+    }
+#endif
+    size_t step = (size_t)sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < len; off += step)
+    {
+        ((volatile char *)base)[off] = 0;
+    }
+}
+
+/**
+ * @brief Pre-grows the heap in one step
+ * The new space lands on the heap list as a single free block, which
+ * every following find_fit() will split from.
+ *
+ * @param bytes 
+ * @param flags MALLOC_RESERVE_PREFAULT to touch the pages now
+ * @return 0 on success, -1 on failure
+ */
+int malloc_reserve(size_t bytes, int flags)
+{
+    header_t *h = grow_heap(bytes);
+    if (!h)
+    {
+        log_msg("MALLOC: malloc_reserve(%zu) failed\n", bytes);
+        return -1;
+    }
+    if (flags & MALLOC_RESERVE_PREFAULT)
+    {
+        prefault((char *)h, HDR_SIZE + h->size);
+    }
+    log_msg("MALLOC: malloc_reserve(%zu) => %zu bytes @%p\n",
+            bytes, h->size, (void *)h);
+    return 0;
+}
+
+/**
+ * @brief Applies MALLOC_RESERVE / MALLOC_PREFAULT on the first malloc()
+ * MALLOC_RESERVE takes a byte count with an optional K, M or G suffix.
+ */
+static void reserve_from_env(void)
+{
+    const char *v = getenv("MALLOC_RESERVE");
+    if (!v || !*v)
+        return;
+
+    char *end;
+    size_t bytes = (size_t)strtoull(v, &end, 10);
+    switch (*end)
+    {
+    case 'g': case 'G': bytes <<= 30; break;
+    case 'm': case 'M': bytes <<= 20; break;
+    case 'k': case 'K': bytes <<= 10; break;
+    default: break;
+    }
+    if (bytes == 0)
+        return;
+
+    const char *pf = getenv("MALLOC_PREFAULT");
+    malloc_reserve(bytes, (pf && *pf && *pf != '0') ?
+                   MALLOC_RESERVE_PREFAULT : 0);
+}
+
 /**
  * @brief Finds a chunk to put the requested data
  * 
@@ -248,8 +539,21 @@ void* malloc(size_t size)
         return NULL;
     }
 
+    // Sampled allocations bypass the heap entirely
+    void *sampled = guard_alloc(size);
+    if (sampled)
+    {
+        log_msg("MALLOC: malloc(%zu) => (ptr=%p, size=%zu) [guarded]\n",
+                size, sampled, size);
+        return sampled;
+    }
+
     size_t requested = ALIGN(size);
     if(!heap_initialized)
+    {
+        reserve_from_env();
+    }
+    if(!heap_initialized)
     {
         // Grow the heap on init
         if (!grow_heap(requested))
@@ -302,6 +606,12 @@ void free(void* ptr)
         log_msg("MALLOC: free(%p)\n", (void*)NULL);
         return;
     }
+    if (guard_owns(ptr))
+    {
+        log_msg("MALLOC: free(%p) [guarded]\n", ptr);
+        guard_free(ptr);
+        return;
+    }
     // If the ptr is not alligned, do nothing
     if((uintptr_t)ptr % ALIGNMENT != 0)
     {
@@ -409,6 +719,21 @@ void *realloc(void* ptr, size_t size)
         return NULL;
     }
 
+    // Sampled blocks never grow in place, always move them
+    if (guard_owns(ptr))
+    {
+        size_t old = guard_size(ptr);
+        void *newp = malloc(size);
+        if (newp)
+        {
+            memcpy(newp, ptr, old < size ? old : size);
+            free(ptr);
+        }
+        log_msg("MALLOC: realloc(%p,%zu) => (ptr=%p, size=%zu)\n",
+                ptr, size, newp, newp ? size : (size_t)0);
+        return newp;
+    }
+
     header_t *header = HDR_FROM_PAYLOAD(ptr);
     size_t requested = ALIGN(size);
 
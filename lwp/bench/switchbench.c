@@ -0,0 +1,117 @@
+/**
+ * @file switchbench.c
+ * @brief Cycles per context switch: swap_rfiles() vs swap_rfiles_fast()
+ *
+ * Ping-pongs between main and one side context, the same way
+ * lwp_yield() bounces between two LWPs, and reports rdtsc cycles
+ * per switch for each routine.  swap_rfiles() is timed with the
+ * legacy fxsave area and with each xsave flavour the CPU has.
+ *
+ *   make bench && ./switchbench [switches]
+ */
+#include "lwp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#define SIDE_STACK (64*1024)
+#define XAREA_MAX  (16*1024)
+
+// set up by liblwp.c when it loads
+extern unsigned int lwp_xsave_mode;
+
+static rfile main_ctx, side_ctx;
+static uint8_t main_xarea[XAREA_MAX] __attribute__((aligned(64)));
+static uint8_t side_xarea[XAREA_MAX] __attribute__((aligned(64)));
+static void (*swap)(rfile *, rfile *);
+
+/**
+ * @brief Runs on the side stack, switches straight back every time
+ */
+static void side(void)
+{
+    for (;;)
+    {
+        swap(&side_ctx, &main_ctx);
+    }
+}
+
+/**
+ * @brief Gives ctx an initial FPU state, in area or (NULL) in fxsave
+ */
+static void init_fpu(rfile *ctx, uint8_t *area)
+{
+    ctx->fxsave = FPU_INIT;
+    ctx->xsave = area;
+    if (area)
+    {
+        memset(area, 0, XAREA_MAX);
+        memcpy(area, &ctx->fxsave, sizeof(ctx->fxsave));
+        *(uint64_t *)(area + 512) = 0x3;    // XSTATE_BV: x87 + SSE
+    }
+}
+
+/**
+ * @brief Points side_ctx at a fresh fake frame that "returns" into side()
+ */
+static void make_side(void)
+{
+    static unsigned long stack[SIDE_STACK / sizeof(unsigned long)]
+        __attribute__((aligned(16)));
+    uintptr_t top = ((uintptr_t)stack + sizeof(stack)) & ~0xFUL;
+    uintptr_t frame = top - 24;
+
+    *(uint64_t *)(frame)      = 0;
+    *(uint64_t *)(frame + 8)  = (uint64_t)(uintptr_t)side;
+    *(uint64_t *)(frame + 16) = 0;
+
+    side_ctx.saved = RFILE_FULL;
+    side_ctx.rbp = frame;
+    side_ctx.rsp = frame;
+}
+
+/**
+ * @brief Average cycles for one switch (half a round trip)
+ */
+static double run(void (*fn)(rfile *, rfile *), unsigned int mode, long n)
+{
+    lwp_xsave_mode = mode;
+    init_fpu(&main_ctx, mode == XSAVE_NONE ? NULL : main_xarea);
+    init_fpu(&side_ctx, mode == XSAVE_NONE ? NULL : side_xarea);
+    swap = fn;
+    make_side();
+    swap(&main_ctx, &side_ctx);     // warm up and enter side()
+
+    uint64_t start = __rdtsc();
+    for (long i = 0; i < n; i++)
+    {
+        swap(&main_ctx, &side_ctx);
+    }
+    return (double)(__rdtsc() - start) / (2.0 * n);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *names[] = {
+        "fxsave", "xsave", "xsaveopt", "xsavec"
+    };
+    long n = argc > 1 ? strtol(argv[1], NULL, 10) : 5000000;
+    unsigned int best = lwp_xsave_mode;
+
+    printf("%ld round trips\n", n);
+    for (unsigned int mode = XSAVE_NONE; mode <= best; mode++)
+    {
+        // xsavec is only known to be there if it's the one picked
+        if (mode == XSAVE_C && best != XSAVE_C)
+        {
+            continue;
+        }
+        printf("  swap_rfiles %-9s %6.1f cycles/switch\n", names[mode],
+               run(swap_rfiles, mode, n));
+    }
+    printf("  swap_rfiles_fast      %6.1f cycles/switch\n",
+           run(swap_rfiles_fast, XSAVE_NONE, n));
+    return 0;
+}
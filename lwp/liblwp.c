@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "lwp.h"
 #include "schedulers.h"
 #include <stdlib.h>
@@ -7,6 +8,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <cpuid.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <time.h>
+#include <link.h>
+#include "wsdeque.h"
+#include "lwpint.h"
 
 // --------- GLOBALS -------
 extern struct scheduler rr_vtable;
@@ -21,13 +32,121 @@ static thread all_list_tail = NULL;
 static thread term_head = NULL;
 static thread term_tail = NULL;
 
+// Open-addressed tid -> thread table for tid2thread()
+#define TID_TABLE_MIN 64
+static thread *tid_table = NULL;
+static size_t tid_cap = 0;          // power of two
+static size_t tid_count = 0;
+static unsigned int tid_shift = 64;
+
 static tid_t next_tid = 1;
 scheduler default_scheule = &rr_vtable;
-scheduler curr_schedule = NULL;
-static thread curr_thread = NULL;
 static int system_started = 0;
 
+// One per kernel thread that runs LWPs. Normally that's just
+// main_worker on the caller's thread; lwp_set_workers() asks for
+// more (M:N). Schedulers keep their queues per kernel thread, so
+// each worker's policy instance only sees its own threads.
+typedef struct worker {
+    thread    curr;             // LWP running here
+    scheduler sched;            // this worker's policy
+    thread    idle;             // M:N: waits here for work
+    int       unlock;           // drop lib_lock once switched away
+    int       id;
+    pid_t     ktid;             // kernel thread, for its preempt timer
+    int       has_timer;
+    timer_t   timer;
+    wsdeque   dq;               // spilled work others may steal
+    unsigned  io_tick;          // yields since I/O was last checked
+    thread    shstk_sw;         // copies frames onto shared stacks
+    thread    shstk_next;       // who it's copying in
+} worker;
+
+static worker main_worker;
+static __thread worker *self_worker = NULL;
+static worker **workers = NULL;     // M:N: workers[0] is main_worker
+static int nworkers = 1;
+static int mn_mode = 0;
+
+// M:N: guards the lists, tid table and stack cache shared by all
+// workers. lwp_wait()/lwp_exit() hold it across their switch so no
+// one else can pick the thread up before its registers are saved.
+static atomic_flag lib_lock = ATOMIC_FLAG_INIT;
+
+// Threads that are running or runnable; with none left, nothing
+// can ever wake up again and an idle worker ends the process
+static atomic_long lwp_ready = 0;
+static int last_status = 0;         // status exit() reports then
+
+#define MN_SPILL_MAX 8      // most threads spilled to the deque per yield
+#define IO_POLL_EVERY 64    // busy yields between checks for ready I/O
+#define TASK_BATCH 16       // most tasks run per yield or idle pass
+#define MN_IDLE_WAIT_NS 1000000LL   // idle worker's wait for I/O or
+                                    // timers before looking for
+                                    // stealable work again
+
+// Preemption: each worker gets a timer that sends it PREEMPT_SIGNAL
+// every quantum. SIGURG is ignored by default and rarely used.
+#define PREEMPT_SIGNAL SIGURG
+#define PREEMPT_NO_GO_MAX 8
+static long preempt_quantum_us = 0;     // 0: cooperative only
+static int preempt_installed = 0;
+
+// Code we never switch out of from the handler, the LWP might be
+// holding one of libc's locks: [start, end) text ranges
+static struct { uintptr_t start, end; } preempt_no_go[PREEMPT_NO_GO_MAX];
+static int preempt_no_go_len = 0;
+
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+#define MN_IDLE_STACK (64*1024)
+
 #define STACK_SIZE 8*1024*1024 // 8MB default stack size
+
+// Reaped stacks are kept here and handed to the next lwp_create()
+// instead of going back to the kernel
+#define STACK_CACHE_MAX 16
+// Set to 0 to keep dirty stack pages resident while cached
+#define STACK_CACHE_MADVISE 1
+// Smaller stacks (coroutines, idle loops) aren't worth the syscall
+#define STACK_CACHE_MADVISE_MIN (256*1024)
+
+typedef struct {
+    void *stack;        // usable base, guard sits just below
+    size_t size;
+    size_t guard;
+} cached_stack;
+
+static cached_stack stack_cache[STACK_CACHE_MAX];
+static int stack_cache_len = 0;
+static size_t lwp_stack_size = 0;  // set once at library load
+
+// LWPs made with lwp_attr.shared take turns on one of these. Only
+// the owner's frames are on it; everyone else's wait in their
+// shstk_save buffer until a switch copies them back. 1:1 mode only.
+struct lwp_shstack {
+    char   *base;       // usable base, guard sits just below
+    size_t  size;
+    thread  owner;      // whose frames are on it now
+    long    users;      // threads made on it, not reaped yet
+};
+
+#define SHSTK_SAVE_ROUND 256        // save buffers grow in these steps
+#define SHSTK_SW_STACK (16*1024)    // the switcher's own stack
+static long shstk_threads = 0;      // keeps lwp_set_workers() at 1
+
+// How swap_rfiles() saves extended state (XSAVE_* in lwp.h) and which
+// components, read from magic64.S. All set once at library load.
+unsigned int lwp_xsave_mode __attribute__((visibility("hidden"))) = XSAVE_NONE;
+uint64_t lwp_xsave_mask __attribute__((visibility("hidden"))) = 0;
+static size_t lwp_xsave_size = 0;  // bytes per context, 0 = fxsave only
+
+// Linux keeps big opt-in components (AMX tiles) out of a process
+// until it asks for them; these aren't in every libc's headers
+#ifndef ARCH_GET_XCOMP_PERM
+#define ARCH_GET_XCOMP_PERM 0x1022
+#endif
 // --------- HELPER FUNCTIONS -------
 
 /**
@@ -77,130 +196,1321 @@ static thread fifo_pop(thread *head, thread* tail)
  */
 static void all_remove(thread *head, thread *tail, thread target)
 {
-    if (*head == NULL || target == NULL)
+    if (target == NULL)
         return;
 
-    // If the head is the target, update accordingly
-    if (*head == target)
+    // Doubly linked (lib_one forward, lib_prev back), so no search
+    if (target->lib_prev)
+    {
+        target->lib_prev->lib_one = target->lib_one;
+    }
+    else if (*head == target)
     {
         *head = target->lib_one;
-        if (*tail == target)
+    }
+    else
+    {
+        return; // not on the list
+    }
+
+    if (target->lib_one)
+    {
+        target->lib_one->lib_prev = target->lib_prev;
+    }
+    else
+    {
+        *tail = target->lib_prev;
+    }
+    target->lib_one = NULL;
+    target->lib_prev = NULL;
+}
+
+/**
+ * @brief Add a thread to the global all thread FIFO
+ */
+static void all_add(thread *head, thread *tail, thread target)
+{
+    // If the start of the FIFO, update
+    target->lib_one = NULL;
+    target->lib_prev = *tail;
+    if (*head == NULL)
+    {
+        *head = *tail = target;
+    }
+
+    // Add to the end of the FIFO
+    else 
+    {
+        (*tail)->lib_one = target;
+        *tail = target;
+    }
+}
+
+/**
+ * @brief Slot for tid: Fibonacci hash, tids are handed out in order
+ */
+static size_t tid_slot(tid_t tid)
+{
+    return (size_t)((tid * 0x9E3779B97F4A7C15ULL) >> tid_shift);
+}
+
+/**
+ * @brief Doubles the tid table (or makes the first one)
+ * @return 0 on success, -1 if out of memory
+ */
+static int tid_grow(void)
+{
+    size_t cap = tid_cap ? tid_cap * 2 : TID_TABLE_MIN;
+    thread *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+    {
+        perror("calloc() tid table");
+        return -1;
+    }
+
+    thread *old = tid_table;
+    size_t old_cap = tid_cap;
+    tid_table = slots;
+    tid_cap = cap;
+    tid_shift = 64 - __builtin_ctzl(cap);
+
+    for (size_t i = 0; i < old_cap; i++)
+    {
+        if (old[i])
+        {
+            size_t j = tid_slot(old[i]->tid);
+            while (tid_table[j])
+            {
+                j = (j + 1) & (tid_cap - 1);
+            }
+            tid_table[j] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+/**
+ * @brief Adds a thread to the tid table
+ * @return 0 on success, -1 if the table couldn't grow
+ */
+static int tid_insert(thread t)
+{
+    // Keep load under 1/2 so probes stay short
+    if ((tid_count + 1) * 2 > tid_cap && tid_grow() != 0)
+    {
+        return -1;
+    }
+    size_t i = tid_slot(t->tid);
+    while (tid_table[i])
+    {
+        i = (i + 1) & (tid_cap - 1);
+    }
+    tid_table[i] = t;
+    tid_count++;
+    return 0;
+}
+
+/**
+ * @brief Removes a thread from the tid table, shifting later
+ * entries of the probe run back so lookups never need tombstones
+ */
+static void tid_delete(thread t)
+{
+    if (!tid_cap)
+    {
+        return;
+    }
+    size_t mask = tid_cap - 1;
+    size_t i = tid_slot(t->tid);
+    while (tid_table[i] != t)
+    {
+        if (!tid_table[i])
+        {
+            return; // not in the table
+        }
+        i = (i + 1) & mask;
+    }
+
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; tid_table[j]; j = (j + 1) & mask)
+    {
+        // An entry can fill the hole if its home slot isn't
+        // between the hole and where it sits now
+        size_t home = tid_slot(tid_table[j]->tid);
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            tid_table[hole] = tid_table[j];
+            hole = j;
+        }
+    }
+    tid_table[hole] = NULL;
+    tid_count--;
+}
+
+/**
+ * @brief Returns page size 
+ * @return Page Size
+ */
+long get_page_size(void)
+{
+    return sysconf(_SC_PAGE_SIZE);
+}
+
+/**
+ * @brief The worker this kernel thread runs. LWPs can move between
+ * kernel threads in M:N mode, so this must never be inlined or have
+ * its result cached: call it again after anything that can switch.
+ */
+static __attribute__((noipa)) worker *cur_worker(void)
+{
+    return self_worker ? self_worker : &main_worker;
+}
+
+/**
+ * @brief Takes the library lock (M:N only)
+ */
+static void lib_lock_acquire(void)
+{
+    if (!mn_mode)
+    {
+        return;
+    }
+    while (atomic_flag_test_and_set_explicit(&lib_lock, memory_order_acquire))
+    {
+        __builtin_ia32_pause();
+    }
+}
+
+/**
+ * @brief Drops the library lock (M:N only)
+ */
+static void lib_lock_release(void)
+{
+    if (mn_mode)
+    {
+        atomic_flag_clear_explicit(&lib_lock, memory_order_release);
+    }
+}
+
+/**
+ * @brief Makes sure the worker has a schedule running
+ */
+static void get_sched(worker *w)
+{
+    // Ensure there is a global default schedule
+    if (!default_scheule)
+    {
+        default_scheule = &rr_vtable;
+    }
+    // If there is no current schedule, make it the default one
+    if (!w->sched)
+    {
+        w->sched = default_scheule;
+        if(w->sched->init)
+        {
+            w->sched->init();
+        }
+    }
+}
+
+/**
+ * @brief Uses the stack limit to calculate the stack size 
+ * Ensures that the stack is a mulitiple of the page size
+ */
+unsigned long get_stack_size(void)
+{
+    struct rlimit limits;
+    size_t stack_size = STACK_SIZE; // default stack size
+    if (getrlimit(RLIMIT_STACK, &limits) == 0)
+    {
+        if (limits.rlim_cur != RLIM_INFINITY && limits.rlim_cur != 0)
+        {
+            stack_size = (size_t)limits.rlim_cur;
+        }
+    }
+    else
+    {
+        perror("getrlimit(): Setting stack to 8MB (default)");
+    }
+
+    // Round up to the next page size!
+    long page_size = get_page_size();
+    if (stack_size % page_size != 0)
+    {
+        stack_size += page_size - (stack_size % page_size);
+    }
+    return stack_size;
+}
+
+/**
+ * @brief Sizes the xsave area from CPUID and picks the cheapest save
+ * instruction the CPU has. Leaves fxsave in place if the CPU or the
+ * OS doesn't do XSAVE.
+ */
+static void xsave_detect(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+        !(ecx & bit_XSAVE) || !(ecx & bit_OSXSAVE))
+    {
+        return;
+    }
+
+    // Everything the OS turned on in XCR0, less anything this
+    // process isn't allowed to touch yet
+    uint32_t lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    uint64_t mask = ((uint64_t)hi << 32) | lo;
+#ifdef __linux__
+    uint64_t perm;
+    if (syscall(SYS_arch_prctl, ARCH_GET_XCOMP_PERM, &perm) == 0)
+    {
+        mask &= perm;
+    }
+#endif
+    // PKRU is a per-kernel-thread permission, not FPU state: a new
+    // context's first xrstor would reset it to allow-all
+    mask &= ~(1ULL << 9);
+
+    // Standard-form size: the end of the highest component we keep.
+    // xsavec's compacted form never needs more.
+    size_t size = 576;              // legacy region + header
+    for (int i = 2; i < 64; i++)
+    {
+        if (mask & (1ULL << i))
+        {
+            __get_cpuid_count(0xd, i, &eax, &ebx, &ecx, &edx);
+            if (ebx + eax > size)
+            {
+                size = ebx + eax;   // offset + size
+            }
+        }
+    }
+    lwp_xsave_mask = mask;
+    lwp_xsave_size = (size + 63) & ~63UL;
+
+    // xsaveopt skips components untouched since the last xrstor,
+    // xsavec skips ones still in their init state
+    __get_cpuid_count(0xd, 1, &eax, &ebx, &ecx, &edx);
+    if (eax & bit_XSAVEOPT)
+    {
+        lwp_xsave_mode = XSAVE_OPT;
+    }
+    else if (eax & bit_XSAVEC)
+    {
+        lwp_xsave_mode = XSAVE_C;
+    }
+    else
+    {
+        lwp_xsave_mode = XSAVE_STD;
+    }
+}
+
+/**
+ * @brief Works out the default stack size once, at library load,
+ * so lwp_create() doesn't call getrlimit() every time
+ */
+static void __attribute__((constructor)) lwp_lib_init(void)
+{
+    lwp_stack_size = get_stack_size();
+    xsave_detect();
+}
+
+/**
+ * @brief Points an rfile at an xsave area inside mem (which needs
+ * lwp_xsave_size + 63 bytes) holding the same initial FPU state
+ * as rf->fxsave
+ */
+static void rfile_xsave_init(rfile *rf, void *mem)
+{
+    uint8_t *area = (uint8_t *)(((uintptr_t)mem + 63) & ~(uintptr_t)63);
+
+    memset(area, 0, lwp_xsave_size);
+    memcpy(area, &rf->fxsave, sizeof(rf->fxsave));
+
+    // XSTATE_BV: x87 and SSE come from the legacy region above,
+    // AVX and up start out in their init state
+    *(uint64_t *)(area + 512) = 0x3;
+    rf->xsave = area;
+}
+
+/**
+ * @brief Puts a runnable thread on w's run queue, noting which queue
+ * that is so lwp_yield_to() can tell it's safe to switch to
+ */
+static void sched_admit(worker *w, thread t)
+{
+    t->lib_worker = w;
+    if (w->sched && w->sched->admit)
+    {
+        w->sched->admit(t);
+    }
+}
+
+/**
+ * @brief Like sched_admit(), but ahead of the threads already queued
+ * if the scheduler has a way to say so
+ */
+static void sched_readmit(worker *w, thread t)
+{
+    if (w->sched && w->sched->readmit)
+    {
+        t->lib_worker = w;
+        w->sched->readmit(t);
+        return;
+    }
+    sched_admit(w, t);
+}
+
+/**
+ * @brief Takes a thread off w's run queue
+ */
+static void sched_remove(worker *w, thread t)
+{
+    t->lib_worker = NULL;
+    if (w->sched && w->sched->remove)
+    {
+        w->sched->remove(t);
+    }
+}
+
+/**
+ * @brief Tells w's scheduler that t, running there, is done with its
+ * current job
+ */
+static void sched_job_end(worker *w, thread t)
+{
+    if (w->sched && w->sched->job_end)
+    {
+        w->sched->job_end(t);
+    }
+}
+
+/**
+ * @brief Allocates a zeroed context with an initial FPU state. The
+ * xsave area, if any, lives in the same block so free() gets both.
+ */
+static thread context_alloc(void)
+{
+    size_t extra = lwp_xsave_size ? lwp_xsave_size + 63 : 0;
+    thread t = (thread)malloc(sizeof(*t) + extra);
+    if (!t)
+    {
+        return NULL;
+    }
+    memset(t, 0, sizeof(*t));
+    t->state.fxsave = FPU_INIT;
+    t->prio = LWP_PRIO_DEFAULT;
+    if (extra)
+    {
+        rfile_xsave_init(&t->state, t + 1);
+    }
+    return t;
+}
+
+/**
+ * @brief Gets a stack with the given usable size and guard, from the
+ * cache if there's one that matches exactly
+ * @return Usable base of the stack, or NULL if mmap() fails
+ */
+static void *stack_get(size_t size, size_t guard)
+{
+    for (int i = stack_cache_len - 1; i >= 0; i--)
+    {
+        if (stack_cache[i].size == size && stack_cache[i].guard == guard)
         {
-            *tail = NULL;
+            void *stack = stack_cache[i].stack;
+            stack_cache[i] = stack_cache[--stack_cache_len];
+            return stack;
         }
-        target->lib_one = NULL;
+    }
+
+    char *map = mmap(NULL, guard + size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("MMAP FAILED!");
+        return NULL;
+    }
+    // Overflowing the stack now faults instead of scribbling on
+    // whatever was mapped below it
+    if (guard && mprotect(map, guard, PROT_NONE) != 0)
+    {
+        perror("mprotect() guard page");
+        munmap(map, guard + size);
+        return NULL;
+    }
+    return map + guard;
+}
+
+/**
+ * @brief Returns a reaped thread's stack to the cache, or unmaps it
+ * if the cache is full. Big cached stacks are MADV_FREE'd so the
+ * kernel can take the dirty pages back under memory pressure.
+ */
+static void stack_put(void *stack, size_t size, size_t guard)
+{
+    if (stack_cache_len == STACK_CACHE_MAX)
+    {
+        munmap((char *)stack - guard, guard + size);
         return;
     }
-    thread prev = *head;
-    thread cur = (*head)->lib_one;
+#if STACK_CACHE_MADVISE && defined(MADV_FREE)
+    if (size >= STACK_CACHE_MADVISE_MIN)
+    {
+        madvise(stack, size, MADV_FREE);
+    }
+#endif
+    stack_cache[stack_cache_len].stack = stack;
+    stack_cache[stack_cache_len].size = size;
+    stack_cache[stack_cache_len].guard = guard;
+    stack_cache_len++;
+}
+
+/**
+ * @brief Unlinks a reaped thread and releases its stack and context.
+ * Caller holds the library lock.
+ */
+static void reap_thread(thread dead)
+{
+    all_remove(&all_list_head, &all_list_tail, dead);
+    tid_delete(dead);
+
+    // free resources, don't unmap original or caller-owned stacks
+    if (dead->stack && dead->stacksize && !(dead->flags & LWP_F_USERSTACK))
+    {
+        stack_put(dead->stack, dead->stacksize, dead->guardsize);
+    }
+    if (dead->shstk)
+    {
+        lwp_shstack *s = dead->shstk;
+        if (s->owner == dead)
+        {
+            s->owner = NULL;
+        }
+        s->users--;
+        shstk_threads--;
+        free(dead->shstk_save);
+    }
+    free(dead->specific_more);
+    free(dead);
+}
+
+// ------------ SHARED STACKS --------------
+
+static void stack_frame(rfile *rf, void *stack, size_t size, void (*entry)());
+static void lwp_wrap(lwpfun fun, void *arg);
+
+/**
+ * @brief Copies the owner's frames off s, from its saved rsp up to
+ * the top, into a save buffer that grows to fit. If it was switched
+ * out inside a coroutine, that rsp is on the coroutine's stack, and
+ * what's on s starts where it resumed the coroutine instead.
+ */
+static void shstk_evict(lwp_shstack *s)
+{
+    thread o = s->owner;
+    s->owner = NULL;
+    if (!o || LWPTERMINATED(o->status))
+    {
+        return;     // it's never coming back
+    }
+
+    uintptr_t sp = o->coro ? lwp_coro_stack_sp(o->coro) : o->state.rsp;
+    size_t len = (uintptr_t)(s->base + s->size) - sp;
+    if (len > o->shstk_cap)
+    {
+        size_t cap = (len + SHSTK_SAVE_ROUND - 1) &
+                     ~(size_t)(SHSTK_SAVE_ROUND - 1);
+        void *save = realloc(o->shstk_save, cap);
+        if (!save)
+        {
+            // Nowhere to keep its frames, and no running it without
+            perror("realloc() shared stack save");
+            exit(1);
+        }
+        o->shstk_save = save;
+        o->shstk_cap = cap;
+    }
+    memcpy(o->shstk_save, (void *)sp, len);
+    o->shstk_len = len;
+}
+
+/**
+ * @brief Puts t's frames back where they were on s. One that's never
+ * run gets the frame lwp_create() would have built.
+ */
+static void shstk_load(lwp_shstack *s, thread t)
+{
+    if (t->shstk_len)
+    {
+        memcpy(s->base + s->size - t->shstk_len, t->shstk_save,
+               t->shstk_len);
+    }
+    else
+    {
+        stack_frame(&t->state, s->base, s->size, lwp_wrap);
+    }
+    s->owner = t;
+}
+
+/**
+ * @brief The switcher's loop, on a stack of its own: trades the frames
+ * on the shared stack for the next thread's and goes there
+ */
+static void shstk_switcher(void)
+{
+    for (;;)
+    {
+        worker *w = cur_worker();
+        thread next = w->shstk_next;
+        shstk_evict(next->shstk);
+        shstk_load(next->shstk, next);
+        swap_rfiles_fast(&w->shstk_sw->state, &next->state);
+    }
+}
+
+/**
+ * @brief Gives w a switcher if it hasn't one yet. Lock held.
+ * @return 0, or -1 if out of memory
+ */
+static int shstk_switcher_init(worker *w)
+{
+    if (w->shstk_sw)
+    {
+        return 0;
+    }
+    thread sw = context_alloc();
+    void *stack = stack_get(SHSTK_SW_STACK, get_page_size());
+    if (!sw || !stack)
+    {
+        free(sw);
+        if (stack)
+        {
+            stack_put(stack, SHSTK_SW_STACK, get_page_size());
+        }
+        return -1;
+    }
+    sw->stack = stack;
+    sw->stacksize = SHSTK_SW_STACK;
+    sw->preempt_off = 1;
+    stack_frame(&sw->state, stack, SHSTK_SW_STACK, shstk_switcher);
+    w->shstk_sw = sw;
+    return 0;
+}
+
+/**
+ * @brief Gets next's frames back onto its shared stack before
+ * switch_to() goes there. If prev is running on that very stack it
+ * can't copy over itself, so the worker's switcher does it instead.
+ * @return What to switch to
+ */
+static rfile *shstk_enter(worker *w, thread prev, thread next)
+{
+    lwp_shstack *s = next->shstk;
+    if (prev->shstk == s)
+    {
+        w->shstk_next = next;
+        return &w->shstk_sw->state;
+    }
+    shstk_evict(s);
+    shstk_load(s, next);
+    return &next->state;
+}
+
+/**
+ * @brief Runs first thing on the far side of every switch: lets go
+ * of the library lock if the thread we left was holding it
+ */
+static void finish_switch(void)
+{
+    worker *w = cur_worker();
+    if (w->unlock)
+    {
+        w->unlock = 0;
+        lib_lock_release();
+    }
+}
+
+/**
+ * @brief Switches this worker from its current LWP to next. Returns
+ * when something switches back, maybe on another kernel thread.
+ * @param full Save everything (preemption) rather than just what a
+ * plain call to yield, exit or wait has to keep
+ */
+static void switch_to(worker *w, thread next, int full)
+{
+    thread prev = w->curr;
+    rfile *to = &next->state;
+
+    if (next->shstk && ((lwp_shstack *)next->shstk)->owner != next)
+    {
+        to = shstk_enter(w, prev, next);
+    }
+    w->curr = next;
+
+    if (full)
+    {
+        swap_rfiles(&prev->state, to);
+    }
+    else
+    {
+        swap_rfiles_fast(&prev->state, to);
+    }
+    finish_switch();
+}
+
+static void do_yield(int full);
+
+/**
+ * @brief Keeps the timer from switching the calling LWP out until
+ * the matching lwp_preempt_enable(). Nests.
+ */
+void lwp_preempt_disable(void)
+{
+    thread me = cur_worker()->curr;
+    if (me)
+    {
+        me->preempt_off++;
+        atomic_signal_fence(memory_order_seq_cst);
+    }
+}
+
+/**
+ * @brief Undoes lwp_preempt_disable(). Yields straight away if a
+ * tick came in while preemption was off.
+ */
+void lwp_preempt_enable(void)
+{
+    thread me = cur_worker()->curr;
+    if (!me)
+    {
+        return;
+    }
+    atomic_signal_fence(memory_order_seq_cst);
+    if (--me->preempt_off == 0 && me->preempt_pending)
+    {
+        me->preempt_pending = 0;
+        me->preempt_off++;
+        do_yield(1);
+        me->preempt_off--;
+    }
+}
+
+/**
+ * @brief Is pc inside code we mustn't preempt (libc, the loader)?
+ */
+static int preempt_unsafe_pc(uintptr_t pc)
+{
+    for (int i = 0; i < preempt_no_go_len; i++)
+    {
+        if (pc >= preempt_no_go[i].start && pc < preempt_no_go[i].end)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief dl_iterate_phdr() callback: notes the executable segments
+ * of libc and the dynamic loader
+ */
+static int preempt_find_libc(struct dl_phdr_info *info, size_t size, void *arg)
+{
+    (void)size;
+    (void)arg;
+    const char *name = info->dlpi_name;
+    if (!name || (!strstr(name, "libc.so") && !strstr(name, "ld-linux") &&
+                  !strstr(name, "libpthread")))
+    {
+        return 0;
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr) *ph = &info->dlpi_phdr[i];
+        if (ph->p_type == PT_LOAD && (ph->p_flags & PF_X) &&
+            preempt_no_go_len < PREEMPT_NO_GO_MAX)
+        {
+            uintptr_t start = info->dlpi_addr + ph->p_vaddr;
+            preempt_no_go[preempt_no_go_len].start = start;
+            preempt_no_go[preempt_no_go_len].end = start + ph->p_memsz;
+            preempt_no_go_len++;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Timer tick: switches the running LWP out if it's at a safe
+ * point, otherwise leaves a note for lwp_preempt_enable()
+ */
+static void preempt_handler(int sig, siginfo_t *info, void *ucontext)
+{
+    (void)sig;
+    (void)info;
+    worker *w = cur_worker();
+    thread me = w->curr;
+    if (!system_started || !me || me == w->idle)
+    {
+        return;
+    }
+
+    ucontext_t *uc = ucontext;
+    if (me->preempt_off || preempt_unsafe_pc(uc->uc_mcontext.gregs[REG_RIP]))
+    {
+        me->preempt_pending = 1;
+        return;
+    }
+
+    // The kernel blocked our signal for the handler; let the next
+    // tick through for whoever runs now, preempt_off keeps it from
+    // landing in the middle of the switch
+    me->preempt_off++;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, PREEMPT_SIGNAL);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+
+    me->preempt_pending = 0;
+    do_yield(1);
+    me->preempt_off--;
+}
+
+/**
+ * @brief Points a worker's timer at its kernel thread and (re)arms it
+ * @return 0, or -1 if the timer couldn't be made
+ */
+static int preempt_arm(worker *w)
+{
+    if (!w->has_timer)
+    {
+        struct sigevent sev;
+        memset(&sev, 0, sizeof(sev));
+        sev.sigev_notify = SIGEV_THREAD_ID;
+        sev.sigev_signo = PREEMPT_SIGNAL;
+        sev.sigev_notify_thread_id = w->ktid;
+        if (timer_create(CLOCK_MONOTONIC, &sev, &w->timer) != 0)
+        {
+            perror("timer_create() preempt");
+            return -1;
+        }
+        w->has_timer = 1;
+    }
+
+    struct itimerspec its;
+    its.it_interval.tv_sec = preempt_quantum_us / 1000000;
+    its.it_interval.tv_nsec = (preempt_quantum_us % 1000000) * 1000;
+    its.it_value = its.it_interval;
+    return timer_settime(w->timer, 0, &its, NULL);
+}
+
+/**
+ * @brief Builds a fake frame at the top of a stack so the first
+ * switch to rf "returns" into entry
+ */
+static void stack_frame(rfile *rf, void *stack, size_t size, void (*entry)())
+{
+   /**
+    * What the stack needs to look like on when it was called:
+    * 1 word ret address of LWP_FUN() (can be anything)
+    * 1 word LWP_WRAP() pointer (so it can be used when we pop rip)
+    * 1 word for the base pointer (not used)
+    */
+    uintptr_t top_aligned = ((uintptr_t)stack + size) & ~0xFUL;
+    uintptr_t frame_base = top_aligned - 24;
+
+    // Fake frame: [rbp]=saved_rbp, [rbp+8]=retaddr
+    *(uint64_t*)(frame_base)      = 0;      
+    *(uint64_t*)(frame_base + 8)  = (uint64_t)(uintptr_t)entry;  
+    *(uint64_t*)(frame_base + 16) = 0;
+
+    rf->rbp = frame_base;
+    rf->rsp = frame_base;           
+}
+
+/**
+ * @brief Wrapper function that is used for getting the exit status
+ * of a ran function. 
+ */
+static void lwp_wrap(lwpfun fun, void *arg) { 
+    int rval; 
+    finish_switch();
+    lwp_preempt_enable();   // held by whoever switched to us
+    rval=fun(arg); 
+    lwp_exit(rval); 
+}
+
+// ------------ M:N WORKERS --------------
+
+/**
+ * @brief Grabs a runnable thread for an idle worker: its own spilled
+ * threads first, then other workers' deques
+ * @return The thread, admitted to w's scheduler, or NULL
+ */
+static thread mn_find_work(worker *w)
+{
+    thread t = wsdeque_pop(&w->dq);
+    for (int i = 1; !t && i < nworkers; i++)
+    {
+        t = wsdeque_steal(&workers[(w->id + i) % nworkers]->dq);
+    }
+    if (t)
+    {
+        sched_admit(w, t);
+        t = w->sched->next();
+    }
+    return t;
+}
+
+/**
+ * @brief Evens out work on yield. A spilled thread nobody stole comes
+ * back first, ahead of its peers where the policy allows, and nothing
+ * is spilled that turn; a worker with plenty spills a few for thieves.
+ */
+static void mn_balance(worker *w)
+{
+    scheduler s = w->sched;
+    thread back = wsdeque_pop(&w->dq);
+    if (back)
+    {
+        sched_readmit(w, back);
+        return;
+    }
+
+    int q = s->qlen ? s->qlen() : 0;
+    if (q <= 2)
+    {
+        return;
+    }
+
+    int n = (q - 1) / 2;
+    if (n > MN_SPILL_MAX)
+    {
+        n = MN_SPILL_MAX;
+    }
+    while (n--)
+    {
+        thread t = s->next();
+        if (t == w->curr)
+        {
+            t = s->next();
+        }
+        if (!t || t == w->curr)
+        {
+            break;
+        }
+        sched_remove(w, t);
+        if (wsdeque_push(&w->dq, t) != 0)
+        {
+            sched_admit(w, t);
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Lets sleepers whose time is up, and every so often LWPs
+ * parked on I/O, back in, so a busy run queue can't starve them.
+ * Queued tasks get a turn here too, on the yielding LWP's stack.
+ */
+static void wake_check(worker *w)
+{
+    if (lwp_timer_pending())
+    {
+        lwp_timer_expire();
+    }
+    if (lwp_io_pending() && (++w->io_tick % IO_POLL_EVERY) == 0)
+    {
+        lwp_io_poll(0);
+    }
+    if (lwp_task_pending())
+    {
+        lwp_task_run(TASK_BATCH);
+    }
+}
+
+/**
+ * @brief Nothing to run: sleeps until the next timer is due or I/O
+ * comes in, but no longer than max_ns (< 0: no limit), and wakes
+ * whoever that was for
+ * @return 0 if no LWP waits on either, so none ever will
+ */
+static int idle_wait(long long max_ns)
+{
+    long long ns = lwp_timer_next();
+    int io = lwp_io_pending() != 0;
+    if (ns < 0 && !io)
+    {
+        return 0;
+    }
+    if (max_ns >= 0 && (ns < 0 || ns > max_ns))
+    {
+        ns = max_ns;
+    }
+
+    if (io)
+    {
+        lwp_io_poll(ns);
+    }
+    else if (ns > 0)
+    {
+        struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+        nanosleep(&ts, NULL);
+    }
+    lwp_timer_expire();
+    return 1;
+}
+
+/**
+ * @brief Where a worker sits when it has nothing to run. Waits on I/O
+ * and timers if anyone's parked on them, and ends the process, like
+ * lwp_yield() does in 1:1 mode, once no thread is runnable or waiting
+ * anywhere.
+ */
+static void mn_idle(void)
+{
+    finish_switch();
+    lwp_preempt_enable();
+    for (;;)
+    {
+        worker *w = cur_worker();
+        lwp_preempt_disable();
+        thread t = w->sched->next();
+        if (!t)
+        {
+            t = mn_find_work(w);
+        }
+        if (t)
+        {
+            switch_to(w, t, 0);
+            lwp_preempt_enable();
+            continue;
+        }
+        lwp_preempt_enable();
+        if (lwp_task_run(TASK_BATCH) || idle_wait(MN_IDLE_WAIT_NS))
+        {
+            continue;
+        }
+
+        // Parking and waking only happen under the lock, so this is
+        // the only place the counts agree with each other
+        lwp_lock();
+        int done = atomic_load(&lwp_ready) == 0 && !lwp_timer_pending() &&
+                   !lwp_io_pending() && !lwp_task_pending();
+        lwp_unlock();
+        if (done)
+        {
+            exit(LWPTERMSTAT(last_status));
+        }
+        sched_yield();
+    }
+}
+
+/**
+ * @brief lwp_yield() for M:N: same as 1:1, but falls back to stolen
+ * work and then to the idle loop instead of exiting
+ */
+static void mn_yield(worker *w, int full)
+{
+    if (!w->unlock)         // can't take lib_lock while holding it
+    {
+        wake_check(w);
+    }
+    mn_balance(w);
+
+    thread next = w->sched->next();
+    if (!next)
+    {
+        next = mn_find_work(w);
+    }
+    if (!next)
+    {
+        next = w->idle;
+    }
+    if (next == w->curr)
+    {
+        finish_switch();
+        return;
+    }
+    switch_to(w, next, full);
+}
+
+/**
+ * @brief Body of the extra worker kernel threads
+ */
+static void *mn_worker_main(void *arg)
+{
+    worker *w = arg;
+    self_worker = w;
+    w->ktid = (pid_t)syscall(SYS_gettid);
+    w->curr = w->idle;
+    if (w->sched->init)
+    {
+        w->sched->init();
+    }
+    if (preempt_quantum_us)
+    {
+        preempt_arm(w);
+    }
+    mn_idle();
+    return NULL;
+}
+
+/**
+ * @brief Sets up the workers for lwp_start(). The caller's kernel
+ * thread becomes worker 0; the rest get their own pthreads.
+ * @return 0, or -1 if something couldn't be allocated
+ */
+static int mn_start(void)
+{
+    workers = calloc(nworkers, sizeof(*workers));
+    if (!workers)
+    {
+        perror("calloc() workers");
+        return -1;
+    }
+
+    // Worker 0's idle loop needs a stack of its own, the main
+    // LWP's can't be borrowed while it's blocked
+    main_worker.idle = context_alloc();
+    void *stack = stack_get(MN_IDLE_STACK, get_page_size());
+    if (!main_worker.idle || !stack)
+    {
+        return -1;
+    }
+    main_worker.idle->stack = stack;
+    main_worker.idle->preempt_off = 1;
+    stack_frame(&main_worker.idle->state, stack, MN_IDLE_STACK, mn_idle);
+    wsdeque_init(&main_worker.dq);
+    workers[0] = &main_worker;
+
+    for (int i = 1; i < nworkers; i++)
+    {
+        worker *w = calloc(1, sizeof(*w));
+        if (!w || !(w->idle = context_alloc()))
+        {
+            perror("calloc() worker");
+            return -1;
+        }
+        w->idle->preempt_off = 1;
+        w->id = i;
+        w->sched = main_worker.sched;   // same policy, own queues
+        wsdeque_init(&w->dq);
+        workers[i] = w;
+    }
+
+    mn_mode = 1;
+    for (int i = 1; i < nworkers; i++)
+    {
+        pthread_t pt;
+        if (pthread_create(&pt, NULL, mn_worker_main, workers[i]) != 0)
+        {
+            perror("pthread_create() worker");
+            nworkers = i;           // run with what we got
+            break;
+        }
+        pthread_detach(pt);
+    }
+    return 0;
+}
+
+// ------------ INTERNAL HOOKS (lwpint.h) --------------
+
+/**
+ * @brief Turns preemption off and takes the library lock
+ */
+void lwp_lock(void)
+{
+    lwp_preempt_disable();
+    lib_lock_acquire();
+}
+
+/**
+ * @brief Undoes lwp_lock()
+ */
+void lwp_unlock(void)
+{
+    lib_lock_release();
+    lwp_preempt_enable();
+}
+
+/**
+ * @brief The calling LWP
+ */
+thread lwp_self(void)
+{
+    return cur_worker()->curr;
+}
+
+/**
+ * @brief Blocks the calling LWP until someone lwp_unpark()s it. The
+ * caller holds lwp_lock() and has already put itself on whatever
+ * queue the waker will look in; the lock is dropped once we're
+ * switched out, and isn't held on return.
+ */
+void lwp_park(void)
+{
+    worker *w = cur_worker();
+    thread me = w->curr;
+
+    sched_remove(w, me);
+    sched_job_end(w, me);
+    atomic_fetch_sub(&lwp_ready, 1);
+    last_status = me->status;
+
+    w->unlock = mn_mode;
+    do_yield(0);
+    lwp_preempt_enable();
+}
+
+/**
+ * @brief Makes a parked thread runnable again, on the calling
+ * worker. Caller holds lwp_lock().
+ */
+void lwp_unpark(thread t)
+{
+    worker *w = cur_worker();
+    atomic_fetch_add(&lwp_ready, 1);
+    sched_admit(w, t);
+}
+
+/**
+ * @brief lwp_unpark() and switch straight to t, as lwp_yield_to()
+ * would; the caller stays runnable. Caller holds lwp_lock(), which is
+ * dropped once we're switched out and isn't held on return.
+ */
+void lwp_unpark_to(thread t)
+{
+    worker *w = cur_worker();
+    atomic_fetch_add(&lwp_ready, 1);
+    sched_admit(w, t);
 
-    // Iterate through the FIFO to remove correct thread
-    while(cur)
+    if (w->sched->handoff)
     {
-        if (cur == target)
-        {
-            // Update the prev->next to curr->next
-            prev->lib_one = cur->lib_one;
-            if (*tail == target)
-            {
-                *tail = prev;
-            }
-            target->lib_one = NULL;
-            return;
-        }
-        // Keep iterating if not found
-        prev = cur;
-        cur = cur->lib_one;
+        w->sched->handoff(t);
     }
+    w->unlock = mn_mode;
+    switch_to(w, t, 0);
+    lwp_preempt_enable();
 }
 
 /**
- * @brief Add a thread to the global all thread FIFO
+ * @brief A stack of at least size bytes with the default guard under
+ * it, from the same cache lwp_create() uses
+ * @return Usable base of the stack, or NULL
  */
-static void all_add(thread *head, thread *tail, thread target)
+void *lwp_stack_alloc(size_t size)
 {
-    // If the start of the FIFO, update
-    target->lib_one = NULL;
-    if (*head == NULL)
-    {
-        *head = *tail = target;
-    }
+    size_t page = (size_t)get_page_size();
+    size = (size + page - 1) & ~(page - 1);
+
+    lwp_preempt_disable();
+    lib_lock_acquire();
+    void *stack = stack_get(size, page);
+    lib_lock_release();
+    lwp_preempt_enable();
+    return stack;
+}
 
-    // Add to the end of the FIFO
-    else 
-    {
-        (*tail)->lib_one = target;
-        *tail = target;
-    }
+/**
+ * @brief Gives back a stack from lwp_stack_alloc(size)
+ */
+void lwp_stack_free(void *stack, size_t size)
+{
+    size_t page = (size_t)get_page_size();
+    size = (size + page - 1) & ~(page - 1);
+
+    lwp_preempt_disable();
+    lib_lock_acquire();
+    stack_put(stack, size, page);
+    lib_lock_release();
+    lwp_preempt_enable();
 }
 
 /**
- * @brief Returns page size 
- * @return Page Size
+ * @brief Sets rf up so that switching to it calls entry at the top
+ * of the stack
  */
-long get_page_size(void)
+void lwp_stack_frame(rfile *rf, void *stack, size_t size, void (*entry)())
 {
-    return sysconf(_SC_PAGE_SIZE);
+    stack_frame(rf, stack, size, entry);
 }
 
 /**
- * @brief Returns the current schedule running
+ * @brief Ends the caller's job without blocking, for a sleep that's
+ * already past due, then yields
  */
-static void get_sched(void)
+void lwp_job_end(void)
 {
-    // Ensure there is a global default schedule
-    if (!default_scheule)
+    lwp_lock();
+    worker *w = cur_worker();
+    sched_job_end(w, w->curr);
+    lwp_unlock();
+    lwp_yield();
+}
+
+/**
+ * @brief Memory for whatever a waker writes to while the caller is
+ * parked. An LWP on a shared stack has someone else's frames there
+ * by then, so it gets a heap copy of local instead.
+ * @return local, a copy of it, or NULL if out of memory
+ */
+void *lwp_park_mem(void *local, size_t size)
+{
+    thread me = lwp_self();
+    if (!me || !me->shstk)
     {
-        default_scheule = &rr_vtable;
+        return local;
     }
-    // If there is no current schedule, make it the default one
-    if (!curr_schedule)
+    void *mem = malloc(size);
+    if (mem)
     {
-        curr_schedule = default_scheule;
-        if(curr_schedule->init)
-        {
-            curr_schedule->init();
-        }
+        memcpy(mem, local, size);
     }
+    return mem;
 }
 
 /**
- * @brief Uses the stack limit to calculate the stack size 
- * Ensures that the stack is a mulitiple of the page size
+ * @brief Copies what lwp_park_mem() gave back to local and frees it
  */
-unsigned long get_stack_size(void)
+void lwp_park_mem_done(void *local, void *mem, size_t size)
 {
-    struct rlimit limits;
-    size_t stack_size = STACK_SIZE; // default stack size
-    if (getrlimit(RLIMIT_STACK, &limits) == 0)
-    {
-        if (limits.rlim_cur != RLIM_INFINITY && limits.rlim_cur != 0)
-        {
-            stack_size = (size_t)limits.rlim_cur;
-        }
-    }
-    else
+    if (mem != local)
     {
-        perror("getrlimit(): Setting stack to 8MB (default)");
+        memcpy(local, mem, size);
+        free(mem);
     }
+}
 
-    // Round up to the next page size!
-    long page_size = get_page_size();
-    if (stack_size % page_size != 0)
+/**
+ * @brief Calls fn on every thread on the all-list. Caller holds
+ * lwp_lock().
+ */
+void lwp_each_thread(void (*fn)(thread t, void *arg), void *arg)
+{
+    for (thread t = all_list_head; t; t = t->lib_one)
     {
-        stack_size += page_size - (stack_size % page_size);
+        fn(t, arg);
     }
-    return stack_size;
 }
 
 /**
- * @brief Wrapper function that is used for getting the exit status
- * of a ran function. 
+ * @brief Appends a parked thread to a wait queue
  */
-static void lwp_wrap(lwpfun fun, void *arg) { 
-    int rval; 
-    rval=fun(arg); 
-    lwp_exit(rval); 
+void lwp_waitq_push(thread *head, thread *tail, thread t)
+{
+    fifo_push(head, tail, t);
+}
+
+/**
+ * @brief Takes the longest waiter off a wait queue
+ */
+thread lwp_waitq_pop(thread *head, thread *tail)
+{
+    return fifo_pop(head, tail);
 }
 
  // ------------ MAIN FUNCTIONS --------------
@@ -213,54 +1523,107 @@ static void lwp_wrap(lwpfun fun, void *arg) {
  */
 tid_t lwp_create(lwpfun function, void *argument)
 {
-    // Allocate a stack and a context for each LWP
-    size_t stack_size = get_stack_size();
-    void *stack = mmap(NULL, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE 
-                                    | MAP_ANONYMOUS | MAP_STACK, -1, 0);
-    if (stack == MAP_FAILED)
+    return lwp_create_ex(function, argument, NULL);
+}
+
+/**
+ * @brief Creates a new LWP with explicit stack attributes
+ * @param function The function the LWP executes
+ * @param argument The arguments to the function
+ * @param attr Stack size, guard size and/or a caller-owned stack.
+ * NULL (or zeroed fields) means the defaults.
+ * @return Returns the thread ID of the new thread
+ */
+tid_t lwp_create_ex(lwpfun function, void *argument, const lwp_attr *attr)
+{
+    size_t page = (size_t)get_page_size();
+    size_t stack_size = lwp_stack_size;
+    size_t guard = page;
+    void *stack = NULL;
+    unsigned int flags = 0;
+
+    if (attr && attr->stacksize)
     {
-        perror("MMAP FAILED!");
-        return NO_THREAD;
+        stack_size = attr->stacksize;
+    }
+    if (attr && attr->guardsize)
+    {
+        guard = attr->guardsize == LWP_NO_GUARD ? 0 : attr->guardsize;
     }
 
     // init context
-    thread new_thread = (thread)malloc(sizeof(*new_thread));
+    lwp_preempt_disable();
+    thread new_thread = context_alloc();
     if (!new_thread)
     {
         perror("MALLOC: FAILED");
+        lwp_preempt_enable();
         return NO_THREAD;
     }
 
-    // Clear out the data given from malloc
-    memset(new_thread, 0, sizeof(*new_thread));  
-    
+    lib_lock_acquire();
+    if (attr && attr->shared)
+    {
+        // Nothing goes on the shared stack until its first switch in.
+        // Not for M:N, where two workers could both want it.
+        if (nworkers > 1 || shstk_switcher_init(cur_worker()) != 0)
+        {
+            lib_lock_release();
+            free(new_thread);
+            lwp_preempt_enable();
+            return NO_THREAD;
+        }
+        stack = attr->shared->base;
+        stack_size = attr->shared->size;
+        guard = 0;
+        flags |= LWP_F_USERSTACK;
+        new_thread->shstk = attr->shared;
+    }
+    else if (attr && attr->stack)
+    {
+        // Caller-owned: use exactly what we were given, no guard
+        if (!attr->stacksize)
+        {
+            lib_lock_release();
+            free(new_thread);
+            lwp_preempt_enable();
+            return NO_THREAD;
+        }
+        stack = attr->stack;
+        guard = 0;
+        flags |= LWP_F_USERSTACK;
+    }
+    else
+    {
+        // Allocate a stack, whole pages only
+        stack_size = (stack_size + page - 1) & ~(page - 1);
+        guard = (guard + page - 1) & ~(page - 1);
+        stack = stack_get(stack_size, guard);
+        if (!stack)
+        {
+            lib_lock_release();
+            free(new_thread);
+            lwp_preempt_enable();
+            return NO_THREAD;
+        }
+    }
+
     // Initialize the allocated stack
     new_thread->stack = stack;
     new_thread->stacksize = stack_size;
+    new_thread->guardsize = guard;
+    new_thread->flags = flags;
     new_thread->tid = next_tid++;
     new_thread->status = MKTERMSTAT(LWP_LIVE, 0);
-    new_thread->state.fxsave = FPU_INIT;
     new_thread->exited = NULL;
     new_thread->sched_one = NULL;
+    new_thread->preempt_off = 1;    // lwp_wrap() drops it
 
-   /**
-    * What the stack needs to look like on when it was called:
-    * 1 word ret address of LWP_FUN() (can be anything)
-    * 1 word LWP_WRAP() pointer (so it can be used when we pop rip)
-    * 1 word for the base pointer (not used)
-    */
-    uintptr_t top_aligned = ((uintptr_t)new_thread->stack + 
-                                    new_thread->stacksize) & ~0xFUL;
-    uintptr_t frame_base = top_aligned - 24;
-
-    // Fake frame: [rbp]=saved_rbp, [rbp+8]=retaddr
-    *(uint64_t*)(frame_base)      = 0;      
-    *(uint64_t*)(frame_base + 8)  = (uint64_t)(uintptr_t)lwp_wrap;  
-    *(uint64_t*)(frame_base + 16) = 0;
-
-    // Load context into the state registers
-    new_thread->state.rbp = frame_base;
-    new_thread->state.rsp = frame_base;           
+    // Start out "returning" into lwp_wrap(function, argument)
+    if (!new_thread->shstk)
+    {
+        stack_frame(&new_thread->state, stack, stack_size, lwp_wrap);
+    }
     new_thread->state.rdi = (uint64_t)(uintptr_t)function;  // arg1 to lwp_wrap 
     new_thread->state.rsi = (uint64_t)(uintptr_t)argument;  // arg2 to lwp_wrap 
 
@@ -269,22 +1632,98 @@ tid_t lwp_create(lwpfun function, void *argument)
     {
         next_tid = 1;
     }
-    get_sched();
 
     // Init the next pointers
     new_thread->lib_one = NULL;
     new_thread->lib_two = NULL;
 
     // Add to global list of threads, add to current schedule
+    if (tid_insert(new_thread) != 0)
+    {
+        if (!(flags & LWP_F_USERSTACK))
+        {
+            stack_put(stack, stack_size, guard);
+        }
+        lib_lock_release();
+        free(new_thread);
+        lwp_preempt_enable();
+        return NO_THREAD;
+    }
     all_add(&all_list_head, &all_list_tail, new_thread);
-
-    if (curr_schedule && curr_schedule->admit)
+    if (new_thread->shstk)
     {
-        curr_schedule->admit(new_thread);
+        attr->shared->users++;
+        shstk_threads++;
     }
-    return new_thread->tid;
+    tid_t tid = new_thread->tid;
+    lib_lock_release();
+
+    worker *w = cur_worker();
+    get_sched(w);
+    atomic_fetch_add(&lwp_ready, 1);
+    sched_admit(w, new_thread);
+    lwp_preempt_enable();
+    return tid;
 } 
 
+/**
+ * @brief Makes a stack for LWPs created with lwp_attr.shared to take
+ * turns on
+ * @param size Usable bytes, 0 for the default stack size; a guard
+ * page sits below
+ * @return The stack, or NULL if out of memory
+ */
+lwp_shstack *lwp_shstack_create(size_t size)
+{
+    size_t page = (size_t)get_page_size();
+    lwp_shstack *s = calloc(1, sizeof(*s));
+    if (!s)
+    {
+        return NULL;
+    }
+    size = (size ? size : lwp_stack_size);
+    s->size = (size + page - 1) & ~(page - 1);
+    s->base = lwp_stack_alloc(s->size);
+    if (!s->base)
+    {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+/**
+ * @brief Frees a shared stack
+ * @return 0, or -1 if LWPs made on it haven't all been reaped yet
+ */
+int lwp_shstack_destroy(lwp_shstack *s)
+{
+    if (s->users)
+    {
+        return -1;
+    }
+    lwp_stack_free(s->base, s->size);
+    free(s);
+    return 0;
+}
+
+/**
+ * @brief Asks lwp_start() to run LWPs on n kernel threads instead
+ * of just the caller's. Threads are load balanced by work stealing;
+ * each worker runs its own copy of the scheduling policy.
+ * @return 0, or -1 if n < 1, the system has already started, or
+ * there are LWPs on shared stacks
+ */
+int lwp_set_workers(int n)
+{
+    if (n < 1 || system_started || (n > 1 && shstk_threads))
+    {
+        return -1;
+    }
+    nworkers = n;
+    return 0;
+}
+
 void lwp_start(void)
 {
     if (system_started)
@@ -292,69 +1731,186 @@ void lwp_start(void)
         return;
     }
 
-    get_sched();
+    worker *w = cur_worker();
+    get_sched(w);
 
     // Make a new context for the new thread
-    thread main_thread = (thread)malloc(sizeof(*main_thread));
+    thread main_thread = context_alloc();
     if (!main_thread)
     {
         perror("malloc() main thread failed!");
         exit(1);
     }
-    memset(main_thread, 0, sizeof(*main_thread));
 
-    curr_thread = main_thread;
+    w->curr = main_thread;
+    main_thread->preempt_off = 1;   // until we're all set up
     main_thread->tid = next_tid++;
     main_thread->status = MKTERMSTAT(LWP_LIVE, 0);
-    main_thread->state.fxsave = FPU_INIT;
     main_thread->stack = NULL;
     main_thread->stacksize = 0;
 
     main_thread->lib_one = NULL;
     main_thread->lib_two = NULL;
 
-    all_add(&all_list_head, &all_list_tail, main_thread);
-    if (curr_schedule && curr_schedule->admit)
+    if (tid_insert(main_thread) != 0)
     {
-        curr_schedule->admit(main_thread);
+        exit(1);
     }
+    all_add(&all_list_head, &all_list_tail, main_thread);
+    atomic_fetch_add(&lwp_ready, 1);
+    sched_admit(w, main_thread);
     system_started = 1;
 
+    main_worker.ktid = (pid_t)syscall(SYS_gettid);
+    if (nworkers > 1 && mn_start() != 0)
+    {
+        perror("lwp_start(): M:N workers");
+        exit(1);
+    }
+
     // Save initial state, yield() control
     swap_rfiles(&main_thread->state, NULL);
     lwp_yield();
+    lwp_preempt_enable();
 }
 
 /**
- * @brief Saves context, yields control to next thread
+ * @brief Picks the next thread and switches to it; full says whether
+ * this is the timer (save everything) or a plain call
  */
-void lwp_yield(void)
+static void do_yield(int full)
 {
+    worker *w = cur_worker();
+    if (mn_mode)
+    {
+        mn_yield(w, full);
+        return;
+    }
+
     // Get next thread
     thread next_thread = NULL;
-    if (curr_schedule && curr_schedule->next)
+    wake_check(w);
+    if (w->sched && w->sched->next)
     {
-        next_thread = curr_schedule->next();
+        next_thread = w->sched->next();
     }
 
-    // Terminate the program if there are no more threads!
-    if (next_thread == NULL)
+    // Nothing runnable: run queued tasks, or wait for a sleeper or I/O
+    // if anyone's parked on them, otherwise there are no more threads
+    // and we're done
+    while (next_thread == NULL)
     {
-        exit(LWPTERMSTAT(curr_thread ? curr_thread->status : 0));
+        if (!w->sched || !w->sched->next ||
+            (!lwp_task_run(TASK_BATCH) && !idle_wait(-1)))
+        {
+            exit(LWPTERMSTAT(w->curr ? w->curr->status : 0));
+        }
+        next_thread = w->sched->next();
     }
 
     // If the next thread is the one you are currently running, return
-    if (next_thread == curr_thread)
+    if (next_thread == w->curr)
     {
         return;
     }
 
-    // Update the current thread
-    thread prev = curr_thread;
-    curr_thread = next_thread;
-
     // Context switch
-    swap_rfiles(&prev->state, &next_thread->state);
+    switch_to(w, next_thread, full);
+}
+
+/**
+ * @brief Saves context, yields control to next thread
+ */
+void lwp_yield(void)
+{
+    lwp_preempt_disable();
+    do_yield(0);
+    lwp_preempt_enable();
+}
+
+/**
+ * @brief Switches straight to tid, leaving the run queue as it is:
+ * when the target next yields, the rotation carries on from where it
+ * was. The scheduler's handoff hook hears about it so it can keep its
+ * accounting right. Falls back to lwp_yield() if tid isn't runnable
+ * on this worker's queue.
+ */
+void lwp_yield_to(tid_t tid)
+{
+    thread to = tid2thread(tid);
+
+    lwp_preempt_disable();
+    worker *w = cur_worker();
+    if (!to || to == w->curr || to->lib_worker != w ||
+        LWPSTATE(to->status) != LWP_LIVE)
+    {
+        do_yield(0);
+        lwp_preempt_enable();
+        return;
+    }
+
+    if (w->sched->handoff)
+    {
+        w->sched->handoff(to);
+    }
+    switch_to(w, to, 0);
+    lwp_preempt_enable();
+}
+
+/**
+ * @brief Turns on timer-driven time slicing: every quantum_us the
+ * running LWP is switched out, unless it has preemption disabled or
+ * is inside libc, in which case it goes at the next safe point.
+ * In M:N mode, set it before lwp_start() so each worker arms its
+ * own timer.
+ * @param quantum_us Time slice in microseconds, 0 to go back to
+ * purely cooperative switching
+ * @return 0, or -1 if the timer or handler couldn't be set up
+ */
+int lwp_set_preempt(long quantum_us)
+{
+    if (quantum_us < 0)
+    {
+        return -1;
+    }
+
+    if (!preempt_installed && quantum_us)
+    {
+        dl_iterate_phdr(preempt_find_libc, NULL);
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = preempt_handler;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(PREEMPT_SIGNAL, &sa, NULL) != 0)
+        {
+            perror("sigaction() preempt");
+            return -1;
+        }
+        preempt_installed = 1;
+    }
+    preempt_quantum_us = quantum_us;
+
+    if (!main_worker.ktid)
+    {
+        main_worker.ktid = (pid_t)syscall(SYS_gettid);
+    }
+
+    // Workers that haven't started yet arm themselves
+    int rval = 0;
+    for (int i = 0; i < (mn_mode ? nworkers : 1); i++)
+    {
+        worker *w = mn_mode ? workers[i] : &main_worker;
+        if ((w->has_timer || quantum_us) && (!mn_mode || w->ktid))
+        {
+            if (preempt_arm(w) != 0)
+            {
+                rval = -1;
+            }
+        }
+    }
+    return rval;
 }
 
 /**
@@ -366,31 +1922,39 @@ void lwp_yield(void)
  */
 void lwp_exit(int exitval)
 {
+    lwp_key_exit();         // while we can still block and run
+    lwp_preempt_disable();  // for good, nothing switches back
+    worker *w = cur_worker();
+    thread me = w->curr;
+
     // The exit status is in the low bytes of exitval
-    curr_thread->status = MKTERMSTAT(LWP_TERM, exitval);
+    me->status = MKTERMSTAT(LWP_TERM, exitval);
 
     // Remove from scheduler
-    if (curr_schedule && curr_schedule->remove)
-    {
-        curr_schedule->remove(curr_thread);
-    }
+    sched_remove(w, me);
+    sched_job_end(w, me);
 
     // Check if any thread is blocked in lwp_wait()
+    lib_lock_acquire();
     thread waiter = fifo_pop(&waiting_head, &waiting_tail);
     if (waiter)
     {
         // Hand off: waiter will consume when it resumes
-        waiter->exited = curr_thread;
-        if (curr_schedule && curr_schedule->admit)
-        {
-            curr_schedule->admit(waiter);
-        }
+        waiter->exited = me;
+        atomic_fetch_add(&lwp_ready, 1);
+        sched_admit(w, waiter);
     }
     else 
     {
         // No waiter yet, queue on terminated FIFO
-        fifo_push(&term_head, &term_tail, curr_thread);
+        fifo_push(&term_head, &term_tail, me);
     }
+    atomic_fetch_sub(&lwp_ready, 1);
+    last_status = me->status;
+
+    // Keep the lock until we're off this stack, whoever reaps us
+    // has to take it first
+    w->unlock = mn_mode;
     lwp_yield(); // Switch to enext thread (doesn't return)
 }
 
@@ -407,7 +1971,12 @@ void lwp_exit(int exitval)
  */
 tid_t lwp_wait(int *status)
 {
+    lwp_preempt_disable();
+    worker *w = cur_worker();
+    thread me = w->curr;
+
     // Check if any thread already terminated
+    lib_lock_acquire();
     thread dead = fifo_pop(&term_head, &term_tail);
 
     if (dead)
@@ -421,32 +1990,30 @@ tid_t lwp_wait(int *status)
             *status = LWPTERMSTAT(dead->status);
         }
         
-        // Unlink from global list
-        all_remove(&all_list_head, &all_list_tail, dead);
-
-        // free resources, don't unmap original
-        if (dead->stack && dead->stacksize)
-        {
-            munmap(dead->stack, dead->stacksize);
-        }
-        free(dead);
+        // Unlink from global list, free resources
+        reap_thread(dead);
+        lib_lock_release();
+        lwp_preempt_enable();
         return id;
     }
 
     // Block: remove from scheduler, enqueue on waiting fifo, yield
-    if (curr_schedule && curr_schedule->remove)
-    {
-        curr_schedule->remove(curr_thread);
-    }
+    sched_remove(w, me);
+    sched_job_end(w, me);
 
-    curr_thread->exited = NULL;
+    me->exited = NULL;
 
-    fifo_push(&waiting_head, &waiting_tail, curr_thread);
+    fifo_push(&waiting_head, &waiting_tail, me);
+    atomic_fetch_sub(&lwp_ready, 1);
+    last_status = me->status;
 
+    // Held until we're switched out, so lwp_exit() can't wake us
+    // while our registers are still live
+    w->unlock = mn_mode;
     lwp_yield(); // Block until lwp_exit() pairs with current thread
 
     // Current thread resumed, check what thread handed itself to us
-    dead = curr_thread->exited;
+    dead = me->exited;
     if (dead)
     {
         tid_t id = dead->tid;
@@ -456,17 +2023,16 @@ tid_t lwp_wait(int *status)
         }
 
         // Cleanup: remove from global list and free resources
-        all_remove(&all_list_head, &all_list_tail, dead);
-        if (dead->stack && dead->stacksize)
-        {
-            munmap(dead->stack, dead->stacksize);
-        }
-        free(dead);
-        curr_thread->exited = NULL;
+        lib_lock_acquire();
+        reap_thread(dead);
+        lib_lock_release();
+        me->exited = NULL;
 
+        lwp_preempt_enable();
         return id;
     }
     // Should not get here
+    lwp_preempt_enable();
     return NO_THREAD;
 }
 
@@ -475,23 +2041,40 @@ tid_t lwp_wait(int *status)
  */
 tid_t lwp_gettid(void)
 {
-    return curr_thread ? curr_thread->tid : NO_THREAD;
+    thread me = cur_worker()->curr;
+    return me ? me->tid : NO_THREAD;
 }
 
 /**
- * @brief Iterates through global thread list to find thread
+ * @brief Looks the thread up in the tid table
  * @return Returns the thread from its thread ID
  */
 thread tid2thread(tid_t tid)
 {
-    thread cur = all_list_head;
-    while (cur)
+    thread found = NULL;
+    if (tid == NO_THREAD)
     {
-        if (cur->tid == tid)
-            return cur;
-        cur = cur->lib_one;
+        return NULL;
     }
-    return NULL;
+
+    lwp_preempt_disable();
+    lib_lock_acquire();
+    if (tid_cap)
+    {
+        size_t i = tid_slot(tid);
+        while (tid_table[i])
+        {
+            if (tid_table[i]->tid == tid)
+            {
+                found = tid_table[i];
+                break;
+            }
+            i = (i + 1) & (tid_cap - 1);
+        }
+    }
+    lib_lock_release();
+    lwp_preempt_enable();
+    return found;
 }
 
 /**
@@ -499,21 +2082,24 @@ thread tid2thread(tid_t tid)
  * Inits() the scheduler if needed
  * Admits() old threads into the new thread pool
  * Shutsdown() if needed
+ * In M:N mode this only changes the calling worker's policy.
  */ 
 void lwp_set_scheduler(scheduler new_scheduler)
 {
-    if (new_scheduler == curr_schedule)
+    worker *w = cur_worker();
+    if (new_scheduler == w->sched)
     {
         return;
     }
 
-    scheduler old = curr_schedule;
+    scheduler old = w->sched;
     scheduler new = new_scheduler ? new_scheduler : default_scheule;
 
     if (new == old)
     {
         return;
     }
+    lwp_preempt_disable();
 
     // Init new scheduler (can be NULL)
     if (new->init)
@@ -536,10 +2122,86 @@ void lwp_set_scheduler(scheduler new_scheduler)
             old->shutdown();
         }
     }
-    curr_schedule = new;
+    w->sched = new;
+    lwp_preempt_enable();
 }
 
 scheduler lwp_get_scheduler(void)
 {
-    return curr_schedule;
+    return cur_worker()->sched;
+}
+
+/**
+ * @brief Lets the scheduler requeue a thread whose priority or
+ * deadline just changed. In M:N mode only the caller can be requeued
+ * right away (anyone else may sit on another worker's queue); other
+ * threads get theirs the next time they're admitted.
+ */
+static void sched_requeue(thread t)
+{
+    worker *w = cur_worker();
+    if (w->sched && w->sched->requeue && (!mn_mode || t == w->curr))
+    {
+        w->sched->requeue(t);
+    }
+}
+
+/**
+ * @brief Sets a thread's priority, for schedulers that use one
+ * @param prio LWP_PRIO_MIN to LWP_PRIO_MAX, higher runs first
+ * @return 0, or -1 if there's no such thread or prio is out of range
+ */
+int lwp_set_priority(tid_t tid, int prio)
+{
+    if (prio < LWP_PRIO_MIN || prio > LWP_PRIO_MAX)
+    {
+        return -1;
+    }
+    thread t = tid2thread(tid);
+    if (!t)
+    {
+        return -1;
+    }
+
+    lwp_preempt_disable();
+    t->prio = prio;
+    sched_requeue(t);
+    lwp_preempt_enable();
+    return 0;
+}
+
+/**
+ * @brief Gives a thread a deadline, for edf_vtable. A job ends when
+ * the thread blocks (sleeps, waits, parks or exits); one that ends
+ * past its deadline counts as a miss. With a period the deadline then
+ * moves on by whole periods, otherwise it's cleared.
+ * @param abs_ns Deadline on the lwp_now() clock, 0 for none
+ * @param period_ns 0 for a one-off deadline
+ * @return 0, or -1 if there's no such thread
+ */
+int lwp_set_deadline(tid_t tid, unsigned long long abs_ns,
+                     unsigned long long period_ns)
+{
+    thread t = tid2thread(tid);
+    if (!t)
+    {
+        return -1;
+    }
+
+    lwp_preempt_disable();
+    t->deadline = abs_ns;
+    t->period = abs_ns ? period_ns : 0;
+    sched_requeue(t);
+    lwp_preempt_enable();
+    return 0;
+}
+
+/**
+ * @brief How many of a thread's jobs have ended past their deadline
+ * @return The count, or 0 if there's no such thread
+ */
+unsigned long lwp_get_deadline_misses(tid_t tid)
+{
+    thread t = tid2thread(tid);
+    return t ? t->deadline_misses : 0;
 }
@@ -1,6 +1,10 @@
 #ifndef LWPH
 #define LWPH
 #include <sys/types.h>
+#include <unistd.h>             /* socklen_t */
+#include <poll.h>
+
+struct sockaddr;
 
 #ifndef TRUE
 #define TRUE 1
@@ -31,7 +35,26 @@ registers {
   unsigned long r14;
   unsigned long r15;
   struct fxsave fxsave;   /* space to save floating point state */
+  unsigned long saved;    /* RFILE_FULL or RFILE_FAST: how to reload */
+  void *xsave;            /* 64-byte aligned XSAVE area, or NULL to  */
+                          /* use fxsave above (no AVX state kept)    */
 } rfile;
+
+/* A voluntary switch is a function call, so swap_rfiles_fast() only
+ * keeps what the ABI says a callee must preserve: rbx, rbp, rsp,
+ * r12-r15, MXCSR and the x87 control word.  Either swap routine can
+ * load a context saved by the other.
+ */
+#define RFILE_FULL 0            /* every register + fxsave area */
+#define RFILE_FAST 1            /* callee-saved state only      */
+
+/* How swap_rfiles() saves an rfile with an xsave area.  The library
+ * picks the best one CPUID offers when it loads; xrstor reads them all.
+ */
+#define XSAVE_NONE 0            /* no XSAVE, fxsave only        */
+#define XSAVE_STD  1            /* xsave                        */
+#define XSAVE_OPT  2            /* xsaveopt: skips unmodified   */
+#define XSAVE_C    3            /* xsavec: compacted, skips init*/
 #else
   #error "This only works on x86_64 for now"
 #endif
@@ -39,6 +62,14 @@ registers {
 typedef unsigned long tid_t;
 #define NO_THREAD 0             /* an always invalid thread id */
 
+/* Keys for per-LWP data (lwp_key_create()).  The first LWP_KEYS_INLINE
+ * values sit in the context itself; the rest in an array allocated
+ * the first time one is set.
+ */
+typedef unsigned int lwp_key_t;
+#define LWP_KEYS_INLINE 8
+#define LWP_KEYS_MAX    64
+
 typedef struct threadinfo_st *thread;
 typedef struct threadinfo_st {
   tid_t         tid;            /* lightweight process id  */
@@ -51,10 +82,64 @@ typedef struct threadinfo_st {
   thread        sched_one;      /* NEXT           */
   thread        sched_two;      /* schedulers to use       */
   thread        exited;         /* and one for lwp_wait()  */
+  size_t        guardsize;      /* PROT_NONE bytes below   */
+  unsigned int  flags;          /* LWP_F_* below           */
+  thread        lib_prev;       /* back link for lib_one   */
+  unsigned int  preempt_off;    /* >0: not preemptible now */
+  unsigned int  preempt_pending;/* tick arrived meanwhile  */
+  int           prio;           /* lwp_set_priority()      */
+  int           sched_prio;     /* level it's queued at    */
+  thread        sched_three;    /* third link for trees    */
+  unsigned long long vruntime;  /* fair_vtable: weighted   */
+                                /* cycles run so far       */
+  unsigned long long deadline;  /* lwp_set_deadline(), 0:  */
+  unsigned long long period;    /* none; lwp_now() clock   */
+  unsigned long deadline_misses;/* jobs that ended late    */
+  size_t        sched_idx;      /* slot in array heaps     */
+  void          *lib_worker;    /* run queue it's on       */
+  void          *coro;          /* lwp_coro running on it  */
+  void          *specific[LWP_KEYS_INLINE]; /* key values */
+  void          **specific_more;/* and past the inline ones*/
+  void          *shstk;         /* lwp_shstack it runs on  */
+  void          *shstk_save;    /* its frames while another*/
+  size_t        shstk_len;      /* thread has the stack    */
+  size_t        shstk_cap;
 } context;
 
+#define LWP_F_USERSTACK  0x1    /* stack belongs to the caller */
+
+/* Priority levels for lwp_set_priority(); higher runs first under
+ * prio_vtable.  New threads start in the middle.
+ */
+#define LWP_PRIO_LEVELS  64
+#define LWP_PRIO_MIN     0
+#define LWP_PRIO_MAX     (LWP_PRIO_LEVELS - 1)
+#define LWP_PRIO_DEFAULT (LWP_PRIO_LEVELS / 2)
+
 typedef int (*lwpfun)(void *);  /* type for lwp function */
 
+/* A stack many LWPs run on in turn (lwp_shstack_create()).  Only the
+ * one running keeps its frames there; switching another in copies
+ * the used part out to a buffer sized to fit, so memory goes with
+ * how deep each LWP's stack actually is.  The catch: another LWP
+ * mustn't be given pointers to one's locals, which aren't there while
+ * it's switched out.  1:1 mode only.
+ */
+typedef struct lwp_shstack lwp_shstack;
+
+/* Per-thread attributes for lwp_create_ex().  Zeroed fields get the
+ * defaults: an RLIMIT_STACK-sized stack with a one-page guard.
+ */
+typedef struct lwp_attr {
+  size_t stacksize;             /* usable bytes, rounded up to a page  */
+  size_t guardsize;             /* PROT_NONE bytes under the stack     */
+  void   *stack;                /* caller-owned stack of stacksize     */
+                                /* bytes (no guard added), or NULL     */
+  lwp_shstack *shared;          /* run on this instead; the rest of    */
+                                /* the fields are ignored              */
+} lwp_attr;
+#define LWP_NO_GUARD ((size_t)-1) /* guardsize for "no guard at all" */
+
 /* Tuple that describes a scheduler */
 typedef struct scheduler {
   void   (*init)(void);            /* initialize any structures     */
@@ -63,18 +148,145 @@ typedef struct scheduler {
   void   (*remove)(thread victim); /* remove a thread from the pool */
   thread (*next)(void);            /* select a thread to schedule   */
   int    (*qlen)(void);            /* number of ready threads       */
+  void   (*requeue)(thread t);     /* t's prio/deadline changed     */
+  void   (*handoff)(thread t);     /* lwp_yield_to() runs t next    */
+  void   (*readmit)(thread t);     /* admit t ahead of its peers    */
+  void   (*job_end)(thread t);     /* t blocked, exited or said so  */
 } *scheduler;
 
 /* lwp functions */
 extern tid_t lwp_create(lwpfun,void *);
+extern tid_t lwp_create_ex(lwpfun,void *,const lwp_attr *);
 extern void  lwp_exit(int status);
 extern tid_t lwp_gettid(void);
 extern void  lwp_yield(void);
+extern void  lwp_yield_to(tid_t tid);
 extern void  lwp_start(void);
+extern int   lwp_set_workers(int n);
+extern int   lwp_set_preempt(long quantum_us);
+extern void  lwp_preempt_disable(void);
+extern void  lwp_preempt_enable(void);
+extern int   lwp_set_priority(tid_t tid, int prio);
+extern int   lwp_set_deadline(tid_t tid, unsigned long long abs_ns,
+                              unsigned long long period_ns);
+extern unsigned long lwp_get_deadline_misses(tid_t tid);
 extern tid_t lwp_wait(int *);
 extern void  lwp_set_scheduler(scheduler fun);
 extern scheduler lwp_get_scheduler(void);
 extern thread tid2thread(tid_t tid);
+extern lwp_shstack *lwp_shstack_create(size_t size);
+extern int   lwp_shstack_destroy(lwp_shstack *s);
+
+/* Blocking synchronization.  Waiters are parked off the scheduler
+ * and woken in FIFO order; unlock and signal hand the mutex straight
+ * to the next waiter rather than letting everyone race for it.
+ * Zero-initialized (or *_INITIALIZER) objects are ready to use.
+ */
+typedef struct lwp_mutex {
+  thread owner;                 /* NULL when unlocked      */
+  thread head, tail;            /* parked lockers          */
+} lwp_mutex;
+
+typedef struct lwp_cond {
+  lwp_mutex *mutex;             /* the one waiters hold    */
+  thread head, tail;            /* parked waiters          */
+} lwp_cond;
+
+typedef struct lwp_sem {
+  long   count;
+  thread head, tail;            /* parked waiters          */
+} lwp_sem;
+
+#define LWP_MUTEX_INITIALIZER {NULL, NULL, NULL}
+#define LWP_COND_INITIALIZER  {NULL, NULL, NULL}
+#define LWP_SEM_INITIALIZER(n) {(n), NULL, NULL}
+
+extern void lwp_mutex_init(lwp_mutex *m);
+extern int  lwp_mutex_lock(lwp_mutex *m);
+extern int  lwp_mutex_trylock(lwp_mutex *m);
+extern int  lwp_mutex_unlock(lwp_mutex *m);
+extern void lwp_cond_init(lwp_cond *c);
+extern int  lwp_cond_wait(lwp_cond *c, lwp_mutex *m);
+extern void lwp_cond_signal(lwp_cond *c);
+extern void lwp_cond_broadcast(lwp_cond *c);
+extern void lwp_sem_init(lwp_sem *s, long count);
+extern void lwp_sem_wait(lwp_sem *s);
+extern int  lwp_sem_trywait(lwp_sem *s);
+extern void lwp_sem_post(lwp_sem *s);
+
+/* Channels of pointers between LWPs, as in Go.  cap 0 is unbuffered:
+ * a send waits for its receiver.  A send that finds a receiver parked
+ * drops the value straight into its slot and runs it next.
+ */
+#define LWP_CHAN_UNBOUNDED ((size_t)-1) /* cap for "never full"    */
+#define LWP_CHAN_SEND 0
+#define LWP_CHAN_RECV 1
+
+typedef struct lwp_chan lwp_chan;
+
+typedef struct lwp_chan_case {
+  lwp_chan *chan;               /* NULL: never ready       */
+  int       op;                 /* LWP_CHAN_SEND or _RECV  */
+  void     *val;                /* to send, or received    */
+  int       ok;                 /* 0: found chan closed    */
+} lwp_chan_case;
+
+extern lwp_chan *lwp_chan_create(size_t cap);
+extern void      lwp_chan_destroy(lwp_chan *c);
+extern int       lwp_chan_close(lwp_chan *c);
+extern int       lwp_chan_send(lwp_chan *c, void *val);
+extern int       lwp_chan_recv(lwp_chan *c, void **val);
+extern int       lwp_chan_select(lwp_chan_case *cases, int n, int block);
+
+/* Stackless tasks for small fire-and-forget work.  A task runs to
+ * completion on the stack of whichever LWP yields or worker idles
+ * next: it mustn't block, yield or exit, and carries on later by
+ * spawning another task.
+ */
+typedef void (*lwp_taskfun)(void *);
+
+extern int lwp_spawn_task(lwp_taskfun fn, void *arg);
+
+/* Per-LWP data, like pthread keys.  Values start out NULL in every
+ * LWP; when one exits, the destructor of each key it set gets its
+ * value.
+ */
+extern int   lwp_key_create(lwp_key_t *key, void (*destructor)(void *));
+extern int   lwp_key_delete(lwp_key_t key);
+extern void *lwp_getspecific(lwp_key_t key);
+extern int   lwp_setspecific(lwp_key_t key, const void *val);
+
+/* Asymmetric coroutines for generators and the like.  They run on the
+ * LWP that resumes them, on a small stack of their own, and never go
+ * near the scheduler: a resume or a yield is one register swap.
+ */
+#define LWP_CORO_STACK (64*1024)        /* stacksize 0 gets this   */
+
+typedef struct lwp_coro lwp_coro;
+typedef void *(*lwp_corofun)(void *); /* its return ends it        */
+
+extern lwp_coro *lwp_coro_create(lwp_corofun fun, void *arg,
+                                 size_t stacksize);
+extern void     *lwp_coro_resume(lwp_coro *co, void *val);
+extern void     *lwp_coro_yield(void *val);
+extern int       lwp_coro_done(lwp_coro *co);
+extern void      lwp_coro_destroy(lwp_coro *co);
+
+/* I/O that blocks only the calling LWP.  fds are switched to
+ * O_NONBLOCK; close them with lwp_close().
+ */
+extern ssize_t lwp_read(int fd, void *buf, size_t count);
+extern ssize_t lwp_write(int fd, const void *buf, size_t count);
+extern int     lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen);
+extern int     lwp_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+extern int     lwp_close(int fd);
+
+/* Sleeping that blocks only the calling LWP.  Times are
+ * CLOCK_MONOTONIC nanoseconds, as returned by lwp_now().
+ */
+extern unsigned long long lwp_now(void);
+extern void lwp_sleep(unsigned long long ns);
+extern void lwp_sleep_until(unsigned long long abs_ns);
 
 /* for lwp_wait */
 #define TERMOFFSET        8
@@ -87,5 +299,6 @@ extern thread tid2thread(tid_t tid);
 
 /* prototypes for asm functions */
 void swap_rfiles(rfile *old, rfile *new);
+void swap_rfiles_fast(rfile *old, rfile *new);
 
 #endif
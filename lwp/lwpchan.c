@@ -0,0 +1,461 @@
+#include "lwp.h"
+#include "lwpint.h"
+#include <stdlib.h>
+
+/*
+ * Go-style channels. A channel is a ring of pointers (none for an
+ * unbuffered one) and two queues of parked LWPs, senders and
+ * receivers. Whoever finds the other side waiting deals with it
+ * directly: a sender writes its value straight into a parked
+ * receiver's slot and switches to it, and a receiver takes a parked
+ * sender's value and wakes it, so neither waiter has to come back
+ * and retry. A buffered channel only holds values while nobody is
+ * waiting for them.
+ *
+ * lwp_chan_select() waits on several channels at once the way
+ * lwpio.c waits on several fds: one waiter per case, all on the
+ * parked LWP's stack and sharing a group. The first side to get to
+ * the group claims it; the rest of its waiters are skipped by anyone
+ * who finds them and unlinked once the LWP runs again.
+ */
+
+#define CHAN_INIT_SIZE 16   // first ring for an unbounded channel
+#define SELECT_INLINE  8    // cases select waits on without malloc
+
+struct chan_group;
+
+// One per (parked LWP, case): sits on the channel's send or recv queue
+typedef struct chan_waiter {
+    struct chan_group  *group;
+    lwp_chan_case      *cs;
+    int                 idx;    // which case
+    struct chan_waiter *prev, *next;
+} chan_waiter;
+
+// One per parked LWP: it runs again once one of its cases is done
+typedef struct chan_group {
+    thread t;
+    int    woken;
+    int    done;                // case that completed
+} chan_group;
+
+typedef struct chan_queue {
+    chan_waiter *head, *tail;
+} chan_queue;
+
+struct lwp_chan {
+    void     **buf;             // ring of values sent, not received
+    size_t     size;            // slots in buf
+    size_t     head, len;
+    size_t     cap;             // most values held, or UNBOUNDED
+    int        closed;
+    chan_queue sendq, recvq;    // parked senders and receivers
+};
+
+static unsigned select_seq = 0; // where select starts looking
+
+/**
+ * @brief Makes a channel holding up to cap values: 0 for unbuffered,
+ * LWP_CHAN_UNBOUNDED for one that grows as needed
+ * @return The channel, or NULL if out of memory
+ */
+lwp_chan *lwp_chan_create(size_t cap)
+{
+    lwp_chan *c = calloc(1, sizeof(*c));
+    if (!c)
+    {
+        return NULL;
+    }
+    c->cap = cap;
+    if (cap && cap != LWP_CHAN_UNBOUNDED)
+    {
+        c->buf = malloc(cap * sizeof(*c->buf));
+        if (!c->buf)
+        {
+            free(c);
+            return NULL;
+        }
+        c->size = cap;
+    }
+    return c;
+}
+
+/**
+ * @brief Frees a channel nobody is using any more. Values still in
+ * it are dropped.
+ */
+void lwp_chan_destroy(lwp_chan *c)
+{
+    if (c)
+    {
+        free(c->buf);
+        free(c);
+    }
+}
+
+// ------------ QUEUES --------------
+
+static chan_queue *waiter_queue(chan_waiter *w)
+{
+    lwp_chan *c = w->cs->chan;
+    return w->cs->op == LWP_CHAN_SEND ? &c->sendq : &c->recvq;
+}
+
+static void waiter_push(chan_waiter *w)
+{
+    chan_queue *q = waiter_queue(w);
+    w->next = NULL;
+    w->prev = q->tail;
+    if (q->tail)
+    {
+        q->tail->next = w;
+    }
+    else
+    {
+        q->head = w;
+    }
+    q->tail = w;
+}
+
+/**
+ * @brief Takes w off its channel's queue, if it's still on it
+ */
+static void waiter_unlink(chan_waiter *w)
+{
+    chan_queue *q = waiter_queue(w);
+    if (w->prev)
+    {
+        w->prev->next = w->next;
+    }
+    else if (q->head == w)
+    {
+        q->head = w->next;
+    }
+    else
+    {
+        return;     // already off
+    }
+    if (w->next)
+    {
+        w->next->prev = w->prev;
+    }
+    else
+    {
+        q->tail = w->prev;
+    }
+    w->prev = w->next = NULL;
+}
+
+/**
+ * @brief Takes the longest waiter off q that still wants waking, and
+ * claims its group for that case. Waiters whose group already went
+ * another way are dropped as they're found. Caller holds lwp_lock().
+ * @return The waiter, or NULL if nobody's waiting
+ */
+static chan_waiter *waiter_claim(chan_queue *q)
+{
+    chan_waiter *w;
+    while ((w = q->head) != NULL)
+    {
+        waiter_unlink(w);
+        if (!w->group->woken)
+        {
+            w->group->woken = 1;
+            w->group->done = w->idx;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+// ------------ RING --------------
+
+/**
+ * @brief Whether there's room for one more value, growing an
+ * unbounded ring if it's full
+ */
+static int ring_room(lwp_chan *c)
+{
+    if (c->len < c->size)
+    {
+        return 1;
+    }
+    if (c->cap != LWP_CHAN_UNBOUNDED)
+    {
+        return 0;
+    }
+
+    size_t size = c->size ? c->size * 2 : CHAN_INIT_SIZE;
+    void **buf = malloc(size * sizeof(*buf));
+    if (!buf)
+    {
+        return 0;   // Send waits for a receiver instead
+    }
+    for (size_t i = 0; i < c->len; i++)
+    {
+        buf[i] = c->buf[(c->head + i) % c->size];
+    }
+    free(c->buf);
+    c->buf = buf;
+    c->size = size;
+    c->head = 0;
+    return 1;
+}
+
+static void ring_put(lwp_chan *c, void *val)
+{
+    c->buf[(c->head + c->len) % c->size] = val;
+    c->len++;
+}
+
+static void *ring_get(lwp_chan *c)
+{
+    void *val = c->buf[c->head];
+    c->head = (c->head + 1) % c->size;
+    c->len--;
+    return val;
+}
+
+// ------------ SEND AND RECEIVE --------------
+
+/**
+ * @brief Tries cs's send without waiting. Caller holds lwp_lock().
+ * @param wake Set to a receiver that now has the value, to run next
+ * @return 1 if the case is done (cs->ok says how), 0 if it would
+ * have to wait
+ */
+static int try_send(lwp_chan_case *cs, thread *wake)
+{
+    lwp_chan *c = cs->chan;
+    if (c->closed)
+    {
+        cs->ok = 0;
+        return 1;
+    }
+
+    chan_waiter *w = waiter_claim(&c->recvq);
+    if (w)
+    {
+        w->cs->val = cs->val;
+        w->cs->ok = 1;
+        *wake = w->group->t;
+    }
+    else if (ring_room(c))
+    {
+        ring_put(c, cs->val);
+    }
+    else
+    {
+        return 0;
+    }
+    cs->ok = 1;
+    return 1;
+}
+
+/**
+ * @brief Tries cs's receive without waiting. A value in the ring is
+ * older than any parked sender's, so it goes first and the sender's
+ * takes its place. Caller holds lwp_lock().
+ * @param wake Set to a sender whose value was taken, to unpark
+ * @return 1 if the case is done (cs->ok says how), 0 if it would
+ * have to wait
+ */
+static int try_recv(lwp_chan_case *cs, thread *wake)
+{
+    lwp_chan *c = cs->chan;
+    chan_waiter *w = waiter_claim(&c->sendq);
+
+    if (c->len)
+    {
+        cs->val = ring_get(c);
+        if (w)
+        {
+            ring_put(c, w->cs->val);
+        }
+    }
+    else if (w)
+    {
+        cs->val = w->cs->val;
+    }
+    else if (c->closed)
+    {
+        cs->val = NULL;
+        cs->ok = 0;
+        return 1;
+    }
+    else
+    {
+        return 0;
+    }
+
+    if (w)
+    {
+        w->cs->ok = 1;
+        *wake = w->group->t;
+    }
+    cs->ok = 1;
+    return 1;
+}
+
+/**
+ * @brief Waits until one of the n cases can go ahead and does it.
+ * Cases on a NULL channel never can. When several are ready one is
+ * picked in turn, so none is starved.
+ * @param block 0 to return at once if none is ready
+ * @return Index of the case done, with its ok (and val, for a
+ * receive) filled in; -1 if block is 0 and none was ready, or there
+ * was nothing to wait on
+ */
+int lwp_chan_select(lwp_chan_case *cases, int n, int block)
+{
+    chan_waiter inline_ws[SELECT_INLINE];
+    chan_waiter *ws = inline_ws;
+    thread wake = NULL;
+    int live = 0;
+
+    lwp_lock();
+    unsigned start = select_seq++;
+    for (int k = 0; k < n; k++)
+    {
+        int i = (int)((start + k) % n);
+        lwp_chan_case *cs = &cases[i];
+        if (!cs->chan)
+        {
+            continue;
+        }
+        live++;
+        if (cs->op == LWP_CHAN_SEND ? try_send(cs, &wake)
+                                    : try_recv(cs, &wake))
+        {
+            // A receiver we just filled runs next: it was waiting on
+            // us, and this is where the handoff pays off
+            if (wake && cs->op == LWP_CHAN_SEND)
+            {
+                lwp_unpark_to(wake);
+                return i;
+            }
+            if (wake)
+            {
+                lwp_unpark(wake);
+            }
+            lwp_unlock();
+            return i;
+        }
+    }
+    if (!block || !live)
+    {
+        lwp_unlock();
+        return -1;
+    }
+
+    // Wakers follow pointers into all of these while we're parked
+    chan_group local = { lwp_self(), 0, -1 };
+    chan_group *g = lwp_park_mem(&local, sizeof(local));
+    lwp_chan_case *pcs = g ? lwp_park_mem(cases, n * sizeof(*cases)) : NULL;
+    if (pcs && (n > SELECT_INLINE || pcs != cases))
+    {
+        ws = malloc(n * sizeof(*ws));
+    }
+    if (!pcs || !ws)
+    {
+        if (pcs)
+        {
+            lwp_park_mem_done(cases, pcs, n * sizeof(*cases));
+        }
+        if (g)
+        {
+            lwp_park_mem_done(&local, g, sizeof(local));
+        }
+        lwp_unlock();
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        ws[i].group = g;
+        ws[i].cs = &pcs[i];
+        ws[i].idx = i;
+        ws[i].prev = ws[i].next = NULL;
+        if (pcs[i].chan)
+        {
+            waiter_push(&ws[i]);
+        }
+    }
+    lwp_park();
+
+    // The other side did our case for us; drop out of the rest
+    lwp_lock();
+    for (int i = 0; i < n; i++)
+    {
+        if (pcs[i].chan)
+        {
+            waiter_unlink(&ws[i]);
+        }
+    }
+    lwp_unlock();
+    if (ws != inline_ws)
+    {
+        free(ws);
+    }
+    int done = g->done;
+    lwp_park_mem_done(cases, pcs, n * sizeof(*cases));
+    lwp_park_mem_done(&local, g, sizeof(local));
+    return done;
+}
+
+/**
+ * @brief Sends val, waiting for room (or, unbuffered, for a receiver)
+ * @return 0, or -1 if the channel is closed or NULL
+ */
+int lwp_chan_send(lwp_chan *c, void *val)
+{
+    lwp_chan_case cs = { c, LWP_CHAN_SEND, val, 0 };
+    return lwp_chan_select(&cs, 1, 1) < 0 || !cs.ok ? -1 : 0;
+}
+
+/**
+ * @brief Receives a value into *val, waiting for one to be sent
+ * @return 0, or -1 if the channel is closed and drained, or NULL
+ */
+int lwp_chan_recv(lwp_chan *c, void **val)
+{
+    lwp_chan_case cs = { c, LWP_CHAN_RECV, NULL, 0 };
+    int rval = lwp_chan_select(&cs, 1, 1) < 0 || !cs.ok ? -1 : 0;
+    if (val)
+    {
+        *val = cs.val;
+    }
+    return rval;
+}
+
+/**
+ * @brief Closes the channel: parked receivers wake with nothing, and
+ * parked and future senders fail. Values already in it can still be
+ * received.
+ * @return 0, or -1 if it was already closed
+ */
+int lwp_chan_close(lwp_chan *c)
+{
+    lwp_lock();
+    if (c->closed)
+    {
+        lwp_unlock();
+        return -1;
+    }
+    c->closed = 1;
+
+    chan_waiter *w;
+    while ((w = waiter_claim(&c->recvq)) != NULL)
+    {
+        w->cs->val = NULL;
+        w->cs->ok = 0;
+        lwp_unpark(w->group->t);
+    }
+    while ((w = waiter_claim(&c->sendq)) != NULL)
+    {
+        w->cs->ok = 0;
+        lwp_unpark(w->group->t);
+    }
+    lwp_unlock();
+    return 0;
+}
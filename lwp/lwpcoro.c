@@ -0,0 +1,191 @@
+#include "lwp.h"
+#include "lwpint.h"
+#include <stdlib.h>
+
+/*
+ * Asymmetric coroutines. lwp_coro_resume() swaps from the caller
+ * straight onto the coroutine's stack and lwp_coro_yield() swaps
+ * back, both with swap_rfiles_fast(), since either is just a call.
+ * Nothing here is an LWP: no tid, no run queue, no all-list entry.
+ * A coroutine borrows whichever LWP resumes it, and if that LWP is
+ * switched out meanwhile, the coroutine's frames go with it.
+ *
+ * The one running is recorded in the LWP's context (or, before
+ * lwp_start(), per kernel thread), so yield can find it even after
+ * the LWP has moved to another worker. A coroutine that resumes
+ * another nests: each remembers who to restore when it yields.
+ * Updating the record and swapping happen with preemption off, and
+ * whichever side the swap lands on turns it back on. A shared-stack
+ * LWP switched out in between would be saved from the wrong stack.
+ */
+
+#define CORO_SUSPENDED 0        // can be resumed
+#define CORO_RUNNING   1        // it, or one it resumed, is running
+#define CORO_DEAD      2        // its function returned
+
+struct lwp_coro {
+    rfile       state;          // its registers while suspended
+    rfile       caller;         // the resumer's, while it runs
+    lwp_coro   *prev;           // coroutine that resumed it, if any
+    void       *stack;
+    size_t      stacksize;
+    lwp_corofun fun;
+    void       *arg;
+    void       *val;            // passed across each switch
+    int         status;
+};
+
+static __thread lwp_coro *outside;  // running one, if not in an LWP
+
+/**
+ * @brief Where the running coroutine is recorded for the caller
+ */
+static lwp_coro **cur_slot(void)
+{
+    thread me = lwp_self();
+    return me ? (lwp_coro **)&me->coro : &outside;
+}
+
+/**
+ * @brief First thing on a new coroutine's stack: runs its function
+ * and switches back for good with the result
+ */
+static void coro_main(void)
+{
+    lwp_coro *co = *cur_slot();
+    lwp_preempt_enable();
+
+    co->val = co->fun(co->arg);
+    co->status = CORO_DEAD;
+    lwp_preempt_disable();
+    *cur_slot() = co->prev;
+    swap_rfiles_fast(NULL, &co->caller);
+}
+
+/**
+ * @brief Makes a coroutine that will run fun(arg) when first resumed
+ * @param stacksize Its stack, 0 for LWP_CORO_STACK; a guard page
+ * sits below it
+ * @return The coroutine, or NULL if out of memory
+ */
+lwp_coro *lwp_coro_create(lwp_corofun fun, void *arg, size_t stacksize)
+{
+    if (!fun)
+    {
+        return NULL;
+    }
+    if (!stacksize)
+    {
+        stacksize = LWP_CORO_STACK;
+    }
+
+    lwp_coro *co = calloc(1, sizeof(*co));
+    if (!co)
+    {
+        return NULL;
+    }
+    co->stack = lwp_stack_alloc(stacksize);
+    if (!co->stack)
+    {
+        free(co);
+        return NULL;
+    }
+    co->stacksize = stacksize;
+    co->fun = fun;
+    co->arg = arg;
+    co->status = CORO_SUSPENDED;
+
+    // The first resume "returns" into coro_main(). Only MXCSR and the
+    // control word come back on a fast load, so start them clean.
+    co->state.fxsave = FPU_INIT;
+    co->state.saved = RFILE_FAST;
+    lwp_stack_frame(&co->state, co->stack, stacksize, coro_main);
+    return co;
+}
+
+/**
+ * @brief Runs co until it yields or returns
+ * @param val What its pending lwp_coro_yield() returns; unused on the
+ * first resume, which starts fun(arg)
+ * @return The value it yielded or returned, or NULL if co can't be
+ * resumed (finished, or running)
+ */
+void *lwp_coro_resume(lwp_coro *co, void *val)
+{
+    if (!co || co->status != CORO_SUSPENDED)
+    {
+        return NULL;
+    }
+
+    lwp_preempt_disable();
+    lwp_coro **slot = cur_slot();
+    co->prev = *slot;
+    co->status = CORO_RUNNING;
+    co->val = val;
+    *slot = co;
+    swap_rfiles_fast(&co->caller, &co->state);
+    lwp_preempt_enable();
+
+    // Whoever switched back here already put co->prev back
+    return co->val;
+}
+
+/**
+ * @brief Suspends the running coroutine and hands val to whoever
+ * resumed it
+ * @return The val of the resume that wakes it, or NULL straight away
+ * if not called from a coroutine
+ */
+void *lwp_coro_yield(void *val)
+{
+    lwp_coro **slot = cur_slot();
+    lwp_coro *co = *slot;
+    if (!co)
+    {
+        return NULL;
+    }
+
+    co->val = val;
+    co->status = CORO_SUSPENDED;
+    lwp_preempt_disable();
+    *slot = co->prev;
+    swap_rfiles_fast(&co->state, &co->caller);
+    lwp_preempt_enable();
+    return co->val;
+}
+
+/**
+ * @brief The rsp the LWP had when it resumed the outermost of the
+ * coroutines running on it, of which coro is the innermost
+ */
+uintptr_t lwp_coro_stack_sp(void *coro)
+{
+    lwp_coro *co = coro;
+    while (co->prev)
+    {
+        co = co->prev;
+    }
+    return (uintptr_t)co->caller.rsp;
+}
+
+/**
+ * @brief Whether co's function has returned
+ */
+int lwp_coro_done(lwp_coro *co)
+{
+    return co->status == CORO_DEAD;
+}
+
+/**
+ * @brief Frees co. One that's suspended part way is dropped without
+ * unwinding; one that's running is left alone.
+ */
+void lwp_coro_destroy(lwp_coro *co)
+{
+    if (!co || co->status == CORO_RUNNING)
+    {
+        return;
+    }
+    lwp_stack_free(co->stack, co->stacksize);
+    free(co);
+}
@@ -0,0 +1,85 @@
+#ifndef LWPINTH
+#define LWPINTH
+
+#include <lwp.h>
+
+/* Library-internal hooks shared by liblwp.c and the modules built on
+ * top of it (sync, I/O, timers...).  Not part of the public API.
+ *
+ * lwp_lock() turns preemption off for the calling LWP and, in M:N
+ * mode, takes the library lock.  Every wait queue below is only
+ * touched with it held.
+ */
+#define LWP_HIDDEN __attribute__((visibility("hidden")))
+
+LWP_HIDDEN void   lwp_lock(void);
+LWP_HIDDEN void   lwp_unlock(void);
+LWP_HIDDEN thread lwp_self(void);
+LWP_HIDDEN void   lwp_park(void);          /* lock held; returns unlocked */
+LWP_HIDDEN void   lwp_unpark(thread t);    /* lock held                   */
+LWP_HIDDEN void   lwp_unpark_to(thread t); /* lock held; returns unlocked */
+LWP_HIDDEN void   lwp_job_end(void);       /* as if it blocked, then yield */
+
+/* Stacks for code that runs off an LWP's own (lwp_coro).  One guard
+ * page below; sizes round up to whole pages.
+ */
+LWP_HIDDEN void  *lwp_stack_alloc(size_t size);
+LWP_HIDDEN void   lwp_stack_free(void *stack, size_t size);
+LWP_HIDDEN void   lwp_stack_frame(rfile *rf, void *stack, size_t size,
+                                  void (*entry)());
+
+/* For what a waker writes to while the caller is parked, which can't
+ * be on a shared stack (lwp_attr.shared): returns local, or a heap
+ * copy of it for an LWP on one (NULL if out of memory).  _done copies
+ * it back and frees it.
+ */
+LWP_HIDDEN void  *lwp_park_mem(void *local, size_t size);
+LWP_HIDDEN void   lwp_park_mem_done(void *local, void *mem, size_t size);
+
+/* FIFO of parked threads, linked through lib_two */
+LWP_HIDDEN void   lwp_waitq_push(thread *head, thread *tail, thread t);
+LWP_HIDDEN thread lwp_waitq_pop(thread *head, thread *tail);
+
+/* Every thread the library knows of, live or not.  Lock held. */
+LWP_HIDDEN void   lwp_each_thread(void (*fn)(thread t, void *arg), void *arg);
+
+/* Where an LWP left its own stack to run the coroutine (lwp_coro) it
+ * has running, nested ones included: its saved rsp points into that
+ * coroutine's stack instead.
+ */
+LWP_HIDDEN uintptr_t lwp_coro_stack_sp(void *coro);
+
+/* Runs the calling LWP's key destructors (lwpkey.c) as it exits */
+LWP_HIDDEN void   lwp_key_exit(void);
+
+/* Non-blocking I/O (lwpio.c), driven from the scheduler's idle path.
+ * timeout_ns < 0 waits for as long as it takes.
+ */
+LWP_HIDDEN long   lwp_io_pending(void);
+LWP_HIDDEN int    lwp_io_poll(long long timeout_ns);
+
+/* Stackless tasks (lwptask.c), run from the yield and idle paths */
+LWP_HIDDEN long   lwp_task_pending(void);
+LWP_HIDDEN int    lwp_task_run(int max);
+
+/* Timers (lwptimer.c).  A parked LWP can wait on a timer and something
+ * else at once; *woken records which got there first, and only that
+ * one unparks it.
+ */
+#define LWP_WOKEN_IO    1
+#define LWP_WOKEN_TIMER 2
+
+typedef struct lwp_timer {
+    unsigned long long when;    /* lwp_now() deadline       */
+    thread             t;       /* who to wake              */
+    int               *woken;   /* set once, by the waker   */
+    size_t             idx;     /* heap slot                */
+} lwp_timer;
+
+LWP_HIDDEN int       lwp_timer_add(lwp_timer *tm);    /* lock held */
+LWP_HIDDEN void      lwp_timer_cancel(lwp_timer *tm); /* lock held */
+LWP_HIDDEN long      lwp_timer_pending(void);
+LWP_HIDDEN long long lwp_timer_next(void);   /* ns until due, -1: none */
+LWP_HIDDEN int       lwp_timer_expire(void);
+
+#endif
@@ -0,0 +1,555 @@
+#define _GNU_SOURCE
+#include "lwp.h"
+#include "lwpint.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+
+/*
+ * Non-blocking I/O for LWPs. The wrappers put the fd in O_NONBLOCK
+ * mode and try the call; on EAGAIN the LWP queues on the fd and
+ * parks. Each fd is armed in a shared epoll set with EPOLLONESHOT,
+ * level triggered, so re-arming after a failed try reports readiness
+ * that arrived in between, and no wakeup gets lost. The scheduler's
+ * idle path (and every so often its busy path) calls lwp_io_poll()
+ * to wake whoever's fd became ready.
+ */
+
+#define IO_EVENTS 64            // epoll events handled per poll
+
+struct io_group;
+
+// One per (waiting LWP, fd): sits on the fd's queue
+typedef struct io_waiter {
+    struct io_group  *group;
+    int               fd;
+    uint32_t          events;   // EPOLLIN and/or EPOLLOUT
+    struct io_waiter *prev, *next;
+} io_waiter;
+
+// One per parked LWP: it wakes on the first of its fds to fire
+typedef struct io_group {
+    thread t;
+    int    woken;
+} io_group;
+
+typedef struct io_fd {
+    io_waiter *head, *tail;     // parked waiters
+    int        nonblock;        // we've set O_NONBLOCK
+} io_fd;
+
+static int epfd = -1;
+static io_fd *io_fds = NULL;
+static int io_fds_cap = 0;
+static atomic_long io_parked = 0;   // LWPs waiting on some fd
+
+/**
+ * @brief Slot for fd, growing the table as needed. Caller holds
+ * lwp_lock().
+ * @return The slot, or NULL if out of memory
+ */
+static io_fd *fd_slot(int fd)
+{
+    if (fd >= io_fds_cap)
+    {
+        int cap = io_fds_cap ? io_fds_cap : 64;
+        while (cap <= fd)
+        {
+            cap *= 2;
+        }
+        io_fd *fds = realloc(io_fds, cap * sizeof(*fds));
+        if (!fds)
+        {
+            return NULL;
+        }
+        memset(fds + io_fds_cap, 0, (cap - io_fds_cap) * sizeof(*fds));
+        io_fds = fds;
+        io_fds_cap = cap;
+    }
+    return &io_fds[fd];
+}
+
+/**
+ * @brief Puts fd in non-blocking mode once
+ * @return 0, or -1 with errno set
+ */
+static int make_nonblock(int fd)
+{
+    lwp_lock();
+    io_fd *slot = fd_slot(fd);
+    int done = slot ? slot->nonblock : 0;
+    lwp_unlock();
+    if (done)
+    {
+        return 0;
+    }
+
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0)
+    {
+        return -1;
+    }
+    if (!(flags & O_NONBLOCK) && fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+
+    lwp_lock();
+    slot = fd_slot(fd);
+    if (slot)
+    {
+        slot->nonblock = 1;
+    }
+    lwp_unlock();
+    return 0;
+}
+
+/**
+ * @brief (Re)arms fd for whatever its waiters want. Caller holds
+ * lwp_lock().
+ * @return 0, or -1 with errno set
+ */
+static int fd_arm(int fd, io_fd *slot)
+{
+    uint32_t want = 0;
+    for (io_waiter *w = slot->head; w; w = w->next)
+    {
+        want |= w->events;
+    }
+    if (!want)
+    {
+        return 0;
+    }
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = want | EPOLLONESHOT;
+    ev.data.fd = fd;
+
+    // MOD first: usually already in the set from an earlier wait.
+    // A closed and reused fd number drops out, so ADD it again.
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+    {
+        return 0;
+    }
+    if (errno != ENOENT)
+    {
+        return -1;
+    }
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * @brief Takes a waiter off its fd's queue. Caller holds lwp_lock().
+ */
+static void waiter_unlink(io_waiter *w)
+{
+    io_fd *slot = &io_fds[w->fd];
+    if (w->prev)
+    {
+        w->prev->next = w->next;
+    }
+    else if (slot->head == w)
+    {
+        slot->head = w->next;
+    }
+    else
+    {
+        return;     // already off
+    }
+    if (w->next)
+    {
+        w->next->prev = w->prev;
+    }
+    else
+    {
+        slot->tail = w->prev;
+    }
+    w->prev = w->next = NULL;
+}
+
+/**
+ * @brief io_wait() with its group and timer wherever lwp_park_mem()
+ * put them
+ */
+static int io_park(io_waiter *ws, int n, unsigned long long deadline,
+                   io_group *g, lwp_timer *tm)
+{
+
+    lwp_lock();
+    if (epfd < 0)
+    {
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epfd < 0)
+        {
+            lwp_unlock();
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        io_fd *slot = fd_slot(ws[i].fd);
+        if (!slot)
+        {
+            errno = ENOMEM;
+            goto fail;
+        }
+        ws[i].group = g;
+        ws[i].next = NULL;
+        ws[i].prev = slot->tail;
+        if (slot->tail)
+        {
+            slot->tail->next = &ws[i];
+        }
+        else
+        {
+            slot->head = &ws[i];
+        }
+        slot->tail = &ws[i];
+        if (fd_arm(ws[i].fd, slot) != 0)
+        {
+            n = i + 1;
+            goto fail;
+        }
+    }
+
+    if (deadline && lwp_timer_add(tm) != 0)
+    {
+        errno = ENOMEM;
+        goto fail;
+    }
+    atomic_fetch_add(&io_parked, 1);
+    lwp_park();
+
+    // Woken through one fd or the timer; drop out of everything else
+    lwp_lock();
+    for (int i = 0; i < n; i++)
+    {
+        waiter_unlink(&ws[i]);
+    }
+    if (deadline)
+    {
+        lwp_timer_cancel(tm);
+    }
+    if (g->woken == LWP_WOKEN_TIMER)
+    {
+        atomic_fetch_sub(&io_parked, 1);   // lwp_io_poll() didn't
+    }
+    lwp_unlock();
+    return g->woken == LWP_WOKEN_TIMER;
+
+fail:
+    {
+        int err = errno;
+        for (int i = 0; i < n; i++)
+        {
+            waiter_unlink(&ws[i]);
+        }
+        lwp_unlock();
+        errno = err;
+        return -1;
+    }
+}
+
+/**
+ * @brief Parks the caller until one of the n (fd, events) pairs is
+ * ready, or until deadline (lwp_now() time, 0 for none)
+ * @return 0 if an fd fired, 1 on timeout, or -1 with errno set if an
+ * fd can't be watched (e.g. a regular file)
+ */
+static int io_wait(io_waiter *ws, int n, unsigned long long deadline)
+{
+    // Wakers follow pointers into all of these while we're parked
+    struct { io_group g; lwp_timer tm; } local, *p;
+    local.g = (io_group){ lwp_self(), 0 };
+    p = lwp_park_mem(&local, sizeof(local));
+    io_waiter *pws = p ? lwp_park_mem(ws, n * sizeof(*ws)) : NULL;
+    if (!pws)
+    {
+        if (p)
+        {
+            lwp_park_mem_done(&local, p, sizeof(local));
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+    p->tm = (lwp_timer){ deadline, p->g.t, &p->g.woken, 0 };
+
+    int rval = io_park(pws, n, deadline, &p->g, &p->tm);
+    int err = errno;
+    lwp_park_mem_done(ws, pws, n * sizeof(*ws));
+    lwp_park_mem_done(&local, p, sizeof(local));
+    errno = err;
+    return rval;
+}
+
+/**
+ * @brief Number of LWPs parked on I/O, i.e. whether it's worth the
+ * scheduler's while to poll
+ */
+long lwp_io_pending(void)
+{
+    return atomic_load(&io_parked);
+}
+
+/**
+ * @brief Waits up to timeout_ns (< 0: forever) for fds to become
+ * ready and unparks their waiters
+ * @return Number of LWPs woken
+ */
+int lwp_io_poll(long long timeout_ns)
+{
+    struct epoll_event evs[IO_EVENTS];
+    int woken = 0;
+    int n;
+
+    if (epfd < 0 || atomic_load(&io_parked) == 0)
+    {
+        return 0;
+    }
+    if (timeout_ns < 0)
+    {
+        n = epoll_wait(epfd, evs, IO_EVENTS, -1);
+    }
+    else
+    {
+        struct timespec ts = { timeout_ns / 1000000000LL,
+                               timeout_ns % 1000000000LL };
+        n = epoll_pwait2(epfd, evs, IO_EVENTS, &ts, NULL);
+        if (n < 0 && errno == ENOSYS)
+        {
+            // Pre-5.11 kernel: round up to whole milliseconds
+            n = epoll_wait(epfd, evs, IO_EVENTS,
+                           (int)((timeout_ns + 999999) / 1000000));
+        }
+    }
+    if (n <= 0)
+    {
+        return 0;
+    }
+
+    lwp_lock();
+    for (int i = 0; i < n; i++)
+    {
+        int fd = evs[i].data.fd;
+        uint32_t got = evs[i].events;
+        if (fd >= io_fds_cap)
+        {
+            continue;
+        }
+        io_fd *slot = &io_fds[fd];
+
+        // Errors and hangups wake everyone so the retry reports them
+        if (got & (EPOLLERR | EPOLLHUP))
+        {
+            got |= EPOLLIN | EPOLLOUT;
+        }
+
+        io_waiter *w = slot->head;
+        while (w)
+        {
+            io_waiter *next = w->next;
+            if (w->events & got)
+            {
+                waiter_unlink(w);
+                if (!w->group->woken)
+                {
+                    w->group->woken = LWP_WOKEN_IO;
+                    // Runnable before it stops counting as parked, so
+                    // idle workers never see it as neither
+                    lwp_unpark(w->group->t);
+                    atomic_fetch_sub(&io_parked, 1);
+                    woken++;
+                }
+            }
+            w = next;
+        }
+
+        // One-shot: anyone still waiting (other direction) re-arms
+        fd_arm(fd, slot);
+    }
+    lwp_unlock();
+    return woken;
+}
+
+// ------------ WRAPPERS --------------
+
+/**
+ * @brief read(2) that parks only the calling LWP until fd is readable
+ */
+ssize_t lwp_read(int fd, void *buf, size_t count)
+{
+    if (make_nonblock(fd) != 0)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t n = read(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            return n;
+        }
+        io_waiter w = { .fd = fd, .events = EPOLLIN };
+        if (io_wait(&w, 1, 0) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief write(2) that parks only the calling LWP until fd is writable
+ */
+ssize_t lwp_write(int fd, const void *buf, size_t count)
+{
+    if (make_nonblock(fd) != 0)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        ssize_t n = write(fd, buf, count);
+        if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            return n;
+        }
+        io_waiter w = { .fd = fd, .events = EPOLLOUT };
+        if (io_wait(&w, 1, 0) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief accept(2) that parks only the calling LWP. The new socket
+ * comes back non-blocking, ready for lwp_read()/lwp_write().
+ */
+int lwp_accept(int fd, struct sockaddr *addr, socklen_t *addrlen)
+{
+    if (make_nonblock(fd) != 0)
+    {
+        return -1;
+    }
+    for (;;)
+    {
+        int s = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            return s;
+        }
+        io_waiter w = { .fd = fd, .events = EPOLLIN };
+        if (io_wait(&w, 1, 0) != 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Non-blocking poll(2); the preemption tick can interrupt even
+ * that, so try again
+ */
+static int poll_now(struct pollfd *fds, nfds_t nfds)
+{
+    int n;
+    while ((n = poll(fds, nfds, 0)) < 0 && errno == EINTR)
+    {
+    }
+    return n;
+}
+
+/**
+ * @brief poll(2) that parks only the calling LWP
+ * @param timeout Milliseconds, 0 to just check, -1 for no limit
+ */
+int lwp_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+    unsigned long long deadline = 0;
+    if (timeout > 0)
+    {
+        deadline = lwp_now() + (unsigned long long)timeout * 1000000ULL;
+    }
+
+    for (;;)
+    {
+        int n = poll_now(fds, nfds);
+        if (n != 0 || timeout == 0)
+        {
+            return n;
+        }
+
+        io_waiter *ws = calloc(nfds ? nfds : 1, sizeof(*ws));
+        if (!ws)
+        {
+            return -1;
+        }
+        int k = 0;
+        for (nfds_t i = 0; i < nfds; i++)
+        {
+            uint32_t ev = 0;
+            if (fds[i].events & (POLLIN | POLLPRI))
+            {
+                ev |= EPOLLIN;
+            }
+            if (fds[i].events & POLLOUT)
+            {
+                ev |= EPOLLOUT;
+            }
+            if (fds[i].fd >= 0 && ev)
+            {
+                ws[k].fd = fds[i].fd;
+                ws[k].events = ev;
+                k++;
+            }
+        }
+        int rval;
+        if (k)
+        {
+            rval = io_wait(ws, k, deadline);
+        }
+        else if (deadline)
+        {
+            lwp_sleep_until(deadline);      // nothing to watch
+            rval = 1;
+        }
+        else
+        {
+            errno = EINVAL;
+            rval = -1;
+        }
+        free(ws);
+        if (rval < 0)
+        {
+            return -1;
+        }
+        if (rval > 0)
+        {
+            return poll_now(fds, nfds);     // timed out: last look
+        }
+    }
+}
+
+/**
+ * @brief close(2) that also forgets what the library knew about fd,
+ * so the number can be reused safely
+ */
+int lwp_close(int fd)
+{
+    lwp_lock();
+    if (fd >= 0 && fd < io_fds_cap)
+    {
+        io_fds[fd].nonblock = 0;
+    }
+    lwp_unlock();
+    return close(fd);
+}
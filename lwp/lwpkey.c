@@ -0,0 +1,191 @@
+#include "lwp.h"
+#include "lwpint.h"
+#include <stdlib.h>
+
+/*
+ * Per-LWP data. __thread variables belong to the kernel thread, so
+ * every LWP on it would share them; these live in the LWP's context
+ * instead. A key is an index: the first LWP_KEYS_INLINE are slots in
+ * the context, so lwp_getspecific() is one indexed load off the
+ * running thread, and the rest go in an array the thread allocates
+ * the first time it sets one of them.
+ *
+ * Deleting a key clears its slot in every thread, so a key handed out
+ * again starts out NULL everywhere, as a new one should.
+ */
+
+#define KEY_DTOR_ROUNDS 4       // like PTHREAD_DESTRUCTOR_ITERATIONS
+
+static unsigned char key_used[LWP_KEYS_MAX];
+static void (*key_dtor[LWP_KEYS_MAX])(void *);
+static int keys_with_dtor = 0;  // lets lwp_exit() skip the scan
+
+/**
+ * @brief Where t keeps key's value
+ * @param alloc Allocate the overflow array if t hasn't got one yet
+ * @return The slot, or NULL if there's none (and alloc is 0, or it
+ * couldn't be allocated)
+ */
+static void **key_slot(thread t, lwp_key_t key, int alloc)
+{
+    if (key < LWP_KEYS_INLINE)
+    {
+        return &t->specific[key];
+    }
+    if (!t->specific_more)
+    {
+        if (!alloc)
+        {
+            return NULL;
+        }
+        t->specific_more = calloc(LWP_KEYS_MAX - LWP_KEYS_INLINE,
+                                  sizeof(void *));
+        if (!t->specific_more)
+        {
+            return NULL;
+        }
+    }
+    return &t->specific_more[key - LWP_KEYS_INLINE];
+}
+
+/**
+ * @brief Hands out an unused key
+ * @param destructor Called with an LWP's non-NULL value when it exits,
+ * or NULL for none
+ * @return 0, or -1 if all LWP_KEYS_MAX are in use
+ */
+int lwp_key_create(lwp_key_t *key, void (*destructor)(void *))
+{
+    lwp_lock();
+    for (lwp_key_t k = 0; k < LWP_KEYS_MAX; k++)
+    {
+        if (!key_used[k])
+        {
+            key_used[k] = 1;
+            key_dtor[k] = destructor;
+            if (destructor)
+            {
+                keys_with_dtor++;
+            }
+            lwp_unlock();
+            *key = k;
+            return 0;
+        }
+    }
+    lwp_unlock();
+    return -1;
+}
+
+static void key_clear(thread t, void *arg)
+{
+    void **slot = key_slot(t, *(lwp_key_t *)arg, 0);
+    if (slot)
+    {
+        *slot = NULL;
+    }
+}
+
+/**
+ * @brief Gives a key back. Values still set are dropped without
+ * calling the destructor.
+ * @return 0, or -1 if key isn't in use
+ */
+int lwp_key_delete(lwp_key_t key)
+{
+    lwp_lock();
+    if (key >= LWP_KEYS_MAX || !key_used[key])
+    {
+        lwp_unlock();
+        return -1;
+    }
+    lwp_each_thread(key_clear, &key);
+    if (key_dtor[key])
+    {
+        keys_with_dtor--;
+    }
+    key_dtor[key] = NULL;
+    key_used[key] = 0;
+    lwp_unlock();
+    return 0;
+}
+
+/**
+ * @brief The calling LWP's value for key
+ * @return The value, or NULL if it has none (or isn't an LWP)
+ */
+void *lwp_getspecific(lwp_key_t key)
+{
+    thread me = lwp_self();
+    if (!me || key >= LWP_KEYS_MAX)
+    {
+        return NULL;
+    }
+    if (key < LWP_KEYS_INLINE)
+    {
+        return me->specific[key];
+    }
+    return me->specific_more ?
+           me->specific_more[key - LWP_KEYS_INLINE] : NULL;
+}
+
+/**
+ * @brief Sets the calling LWP's value for key
+ * @return 0, or -1 if key isn't in use, the caller isn't an LWP, or
+ * there's no memory for the value
+ */
+int lwp_setspecific(lwp_key_t key, const void *val)
+{
+    thread me = lwp_self();
+    if (!me || key >= LWP_KEYS_MAX || !key_used[key])
+    {
+        return -1;
+    }
+    void **slot = key_slot(me, key, 1);
+    if (!slot)
+    {
+        return -1;
+    }
+    *slot = (void *)val;
+    return 0;
+}
+
+/**
+ * @brief Runs the exiting LWP's destructors. One may set values
+ * again, so this goes round until none is left, up to a few times.
+ */
+void lwp_key_exit(void)
+{
+    thread me = lwp_self();
+    if (!me || !keys_with_dtor)
+    {
+        return;
+    }
+
+    for (int round = 0; round < KEY_DTOR_ROUNDS; round++)
+    {
+        int ran = 0;
+        for (lwp_key_t k = 0; k < LWP_KEYS_MAX; k++)
+        {
+            void **slot = key_slot(me, k, 0);
+            if (!slot || !*slot)
+            {
+                continue;
+            }
+
+            lwp_lock();
+            void (*dtor)(void *) = key_used[k] ? key_dtor[k] : NULL;
+            lwp_unlock();
+            void *val = *slot;
+            *slot = NULL;
+            if (dtor)
+            {
+                dtor(val);
+                ran = 1;
+            }
+        }
+        if (!ran)
+        {
+            break;
+        }
+    }
+}
@@ -0,0 +1,246 @@
+#include "lwp.h"
+#include "lwpint.h"
+#include <stddef.h>
+
+/*
+ * Mutexes, condition variables and semaphores for LWPs. A thread that
+ * has to wait is parked off the scheduler (like lwp_wait() does) on
+ * the object's FIFO, and whoever releases the object picks the next
+ * owner directly, so a contended handoff costs one wakeup and the
+ * run queue never holds threads that can't make progress.
+ */
+
+// ------------ MUTEX --------------
+
+/**
+ * @brief Sets up an unlocked mutex
+ */
+void lwp_mutex_init(lwp_mutex *m)
+{
+    m->owner = NULL;
+    m->head = m->tail = NULL;
+}
+
+/**
+ * @brief Locks the mutex, parking until it's handed to us
+ * @return 0, or -1 if the caller already holds it
+ */
+int lwp_mutex_lock(lwp_mutex *m)
+{
+    thread me = lwp_self();
+
+    lwp_lock();
+    if (m->owner == NULL)
+    {
+        m->owner = me;
+        lwp_unlock();
+        return 0;
+    }
+    if (m->owner == me)
+    {
+        lwp_unlock();
+        return -1;
+    }
+
+    // lwp_mutex_unlock() makes us the owner before waking us
+    lwp_waitq_push(&m->head, &m->tail, me);
+    lwp_park();
+    return 0;
+}
+
+/**
+ * @brief Locks the mutex only if nobody holds it
+ * @return 0 if we got it, -1 if not
+ */
+int lwp_mutex_trylock(lwp_mutex *m)
+{
+    int rval = -1;
+
+    lwp_lock();
+    if (m->owner == NULL)
+    {
+        m->owner = lwp_self();
+        rval = 0;
+    }
+    lwp_unlock();
+    return rval;
+}
+
+/**
+ * @brief Gives the mutex to its longest waiter, or unlocks it
+ * Caller holds lwp_lock().
+ */
+static void mutex_release(lwp_mutex *m)
+{
+    thread next = lwp_waitq_pop(&m->head, &m->tail);
+    m->owner = next;
+    if (next)
+    {
+        lwp_unpark(next);
+    }
+}
+
+/**
+ * @brief Unlocks the mutex, handing it straight to a waiter if any
+ * @return 0, or -1 if the caller doesn't hold it
+ */
+int lwp_mutex_unlock(lwp_mutex *m)
+{
+    lwp_lock();
+    if (m->owner != lwp_self())
+    {
+        lwp_unlock();
+        return -1;
+    }
+    mutex_release(m);
+    lwp_unlock();
+    return 0;
+}
+
+// ------------ CONDITION VARIABLE --------------
+
+/**
+ * @brief Sets up a condition variable with no waiters
+ */
+void lwp_cond_init(lwp_cond *c)
+{
+    c->mutex = NULL;
+    c->head = c->tail = NULL;
+}
+
+/**
+ * @brief Releases m and parks until signalled; holds m again on return
+ * @return 0, or -1 if the caller doesn't hold m
+ */
+int lwp_cond_wait(lwp_cond *c, lwp_mutex *m)
+{
+    thread me = lwp_self();
+
+    lwp_lock();
+    if (m->owner != me)
+    {
+        lwp_unlock();
+        return -1;
+    }
+    c->mutex = m;
+    lwp_waitq_push(&c->head, &c->tail, me);
+    mutex_release(m);
+
+    // Signal moves us to the mutex's queue (or gives us the mutex),
+    // so by the time we run again it's ours
+    lwp_park();
+    return 0;
+}
+
+/**
+ * @brief Moves one waiter from the condition to its mutex: it gets
+ * the mutex right away if it's free, otherwise it queues for it
+ * without having to wake up first. Caller holds lwp_lock().
+ */
+static int cond_wake_one(lwp_cond *c)
+{
+    thread t = lwp_waitq_pop(&c->head, &c->tail);
+    if (!t)
+    {
+        return 0;
+    }
+
+    lwp_mutex *m = c->mutex;
+    if (m->owner == NULL)
+    {
+        m->owner = t;
+        lwp_unpark(t);
+    }
+    else
+    {
+        lwp_waitq_push(&m->head, &m->tail, t);
+    }
+    return 1;
+}
+
+/**
+ * @brief Wakes the longest waiter, if any
+ */
+void lwp_cond_signal(lwp_cond *c)
+{
+    lwp_lock();
+    cond_wake_one(c);
+    lwp_unlock();
+}
+
+/**
+ * @brief Wakes every waiter
+ */
+void lwp_cond_broadcast(lwp_cond *c)
+{
+    lwp_lock();
+    while (cond_wake_one(c))
+    {
+        ;
+    }
+    lwp_unlock();
+}
+
+// ------------ SEMAPHORE --------------
+
+/**
+ * @brief Sets up a semaphore holding count
+ */
+void lwp_sem_init(lwp_sem *s, long count)
+{
+    s->count = count;
+    s->head = s->tail = NULL;
+}
+
+/**
+ * @brief Takes one, parking until lwp_sem_post() hands us one
+ */
+void lwp_sem_wait(lwp_sem *s)
+{
+    lwp_lock();
+    if (s->count > 0)
+    {
+        s->count--;
+        lwp_unlock();
+        return;
+    }
+    lwp_waitq_push(&s->head, &s->tail, lwp_self());
+    lwp_park();
+}
+
+/**
+ * @brief Takes one only if available
+ * @return 0 if we got one, -1 if not
+ */
+int lwp_sem_trywait(lwp_sem *s)
+{
+    int rval = -1;
+
+    lwp_lock();
+    if (s->count > 0)
+    {
+        s->count--;
+        rval = 0;
+    }
+    lwp_unlock();
+    return rval;
+}
+
+/**
+ * @brief Gives one back: straight to the longest waiter if there is
+ * one, otherwise onto the count
+ */
+void lwp_sem_post(lwp_sem *s)
+{
+    lwp_lock();
+    thread t = lwp_waitq_pop(&s->head, &s->tail);
+    if (t)
+    {
+        lwp_unpark(t);
+    }
+    else
+    {
+        s->count++;
+    }
+    lwp_unlock();
+}
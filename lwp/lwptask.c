@@ -0,0 +1,105 @@
+#include "lwp.h"
+#include "lwpint.h"
+#include <stdlib.h>
+#include <stdatomic.h>
+
+/*
+ * Stackless tasks. A task is just a function and its argument on a
+ * FIFO; it has no context, rfile or stack of its own. The scheduler
+ * runs a few on every yield, on the stack of the LWP that's giving up
+ * the CPU anyway, and drains them when a worker goes idle, so a task
+ * costs a queue push and an indirect call. The flip side is that a
+ * task has to run to completion: to carry on later, it spawns another.
+ */
+
+typedef struct lwp_task {
+    lwp_taskfun      fn;
+    void            *arg;
+    struct lwp_task *next;
+} lwp_task;
+
+static lwp_task *task_head = NULL;
+static lwp_task *task_tail = NULL;
+static atomic_long tasks_queued = 0;    // queued or running
+
+/**
+ * @brief Queues fn(arg) to run to completion on whichever LWP yields
+ * or worker idles next. It runs with preemption off and mustn't
+ * block, yield or exit.
+ * @return 0, or -1 if out of memory
+ */
+int lwp_spawn_task(lwp_taskfun fn, void *arg)
+{
+    lwp_task *t = malloc(sizeof(*t));
+    if (!t)
+    {
+        return -1;
+    }
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+
+    lwp_lock();
+    if (task_tail)
+    {
+        task_tail->next = t;
+    }
+    else
+    {
+        task_head = t;
+    }
+    task_tail = t;
+    atomic_fetch_add(&tasks_queued, 1);
+    lwp_unlock();
+    return 0;
+}
+
+/**
+ * @brief Number of tasks queued or running, i.e. whether there's
+ * still work that could make an LWP runnable
+ */
+long lwp_task_pending(void)
+{
+    return atomic_load(&tasks_queued);
+}
+
+/**
+ * @brief Runs up to max queued tasks on the caller's stack
+ * @return Number run
+ */
+int lwp_task_run(int max)
+{
+    int ran = 0;
+
+    lwp_preempt_disable();
+    while (ran < max)
+    {
+        lwp_lock();
+        lwp_task *t = task_head;
+        if (t)
+        {
+            task_head = t->next;
+            if (!task_head)
+            {
+                task_tail = NULL;
+            }
+        }
+        lwp_unlock();
+        if (!t)
+        {
+            break;
+        }
+
+        lwp_taskfun fn = t->fn;
+        void *arg = t->arg;
+        free(t);
+        fn(arg);
+        ran++;
+
+        // Only now: whatever it spawned or woke is visible, so an
+        // idle worker can't see no work anywhere in between
+        atomic_fetch_sub(&tasks_queued, 1);
+    }
+    lwp_preempt_enable();
+    return ran;
+}
@@ -0,0 +1,273 @@
+#include "lwp.h"
+#include "lwpint.h"
+#include <stdlib.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/*
+ * Timed sleeps for LWPs. A sleeper parks with an lwp_timer from
+ * lwp_park_mem() (its own stack unless that's a shared one), filed in
+ * a 4-ary min-heap keyed on the wakeup time. Keys live in the heap
+ * array itself, and four children share a cache line, so a sift
+ * touches about half as many sleepers' timers as a binary heap would.
+ * The earliest deadline is mirrored in an atomic so the scheduler can
+ * tell whether anything is due without taking the lock; its idle path
+ * sleeps until exactly that deadline.
+ */
+
+typedef struct heap_ent {
+    unsigned long long when;
+    lwp_timer         *tm;
+} heap_ent;
+
+static heap_ent *heap = NULL;
+static size_t heap_len = 0;
+static size_t heap_cap = 0;
+static atomic_ullong next_deadline = ULLONG_MAX;   // heap[0].when
+static atomic_long timers_armed = 0;
+
+#define HEAP_D 4                    // children per node
+#define PARENT(i) (((i) - 1) / HEAP_D)
+
+/**
+ * @brief CLOCK_MONOTONIC in nanoseconds, the clock every LWP deadline
+ * is measured against
+ */
+unsigned long long lwp_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Puts tm at heap slot i and records where it went
+ */
+static void heap_set(size_t i, heap_ent e)
+{
+    heap[i] = e;
+    e.tm->idx = i;
+}
+
+static void sift_up(size_t i)
+{
+    heap_ent e = heap[i];
+    while (i > 0)
+    {
+        size_t parent = PARENT(i);
+        if (heap[parent].when <= e.when)
+        {
+            break;
+        }
+        heap_set(i, heap[parent]);
+        i = parent;
+    }
+    heap_set(i, e);
+}
+
+static void sift_down(size_t i)
+{
+    heap_ent e = heap[i];
+    for (;;)
+    {
+        size_t first = HEAP_D * i + 1;
+        if (first >= heap_len)
+        {
+            break;
+        }
+        size_t end = first + HEAP_D < heap_len ? first + HEAP_D : heap_len;
+        size_t child = first;
+        for (size_t c = first + 1; c < end; c++)
+        {
+            if (heap[c].when < heap[child].when)
+            {
+                child = c;
+            }
+        }
+        if (e.when <= heap[child].when)
+        {
+            break;
+        }
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, e);
+}
+
+/**
+ * @brief Republishes the earliest deadline after the heap changed
+ */
+static void heap_publish(void)
+{
+    atomic_store(&next_deadline, heap_len ? heap[0].when : ULLONG_MAX);
+    atomic_store(&timers_armed, (long)heap_len);
+}
+
+/**
+ * @brief Arms tm. Caller holds lwp_lock().
+ * @return 0, or -1 if the heap couldn't grow
+ */
+int lwp_timer_add(lwp_timer *tm)
+{
+    if (heap_len == heap_cap)
+    {
+        size_t cap = heap_cap ? heap_cap * 2 : 64;
+        heap_ent *h = realloc(heap, cap * sizeof(*h));
+        if (!h)
+        {
+            return -1;
+        }
+        heap = h;
+        heap_cap = cap;
+    }
+    heap_ent e = { tm->when, tm };
+    heap_set(heap_len++, e);
+    sift_up(tm->idx);
+    heap_publish();
+    return 0;
+}
+
+/**
+ * @brief Takes tm out of the heap, if it's still there
+ */
+static void heap_remove(lwp_timer *tm)
+{
+    size_t i = tm->idx;
+    if (i >= heap_len || heap[i].tm != tm)
+    {
+        return;     // already fired
+    }
+    heap_ent last = heap[--heap_len];
+    if (last.tm != tm)
+    {
+        heap_set(i, last);
+        if (i > 0 && heap[PARENT(i)].when > last.when)
+        {
+            sift_up(i);
+        }
+        else
+        {
+            sift_down(i);
+        }
+    }
+    tm->idx = (size_t)-1;
+}
+
+/**
+ * @brief Disarms tm if it hasn't fired. Caller holds lwp_lock().
+ */
+void lwp_timer_cancel(lwp_timer *tm)
+{
+    heap_remove(tm);
+    heap_publish();
+}
+
+/**
+ * @brief Number of armed timers, i.e. whether an idle scheduler has
+ * something to wait for
+ */
+long lwp_timer_pending(void)
+{
+    return atomic_load(&timers_armed);
+}
+
+/**
+ * @brief Nanoseconds until the next timer is due
+ * @return 0 if one already is, -1 if none is armed
+ */
+long long lwp_timer_next(void)
+{
+    unsigned long long when = atomic_load(&next_deadline);
+    if (when == ULLONG_MAX)
+    {
+        return -1;
+    }
+    unsigned long long now = lwp_now();
+    return when > now ? (long long)(when - now) : 0;
+}
+
+/**
+ * @brief Wakes the owners of every timer that's due
+ * @return Number of LWPs woken
+ */
+int lwp_timer_expire(void)
+{
+    if (atomic_load(&next_deadline) > lwp_now())
+    {
+        return 0;
+    }
+
+    int woken = 0;
+    lwp_lock();
+    unsigned long long now = lwp_now();
+    while (heap_len && heap[0].when <= now)
+    {
+        lwp_timer *tm = heap[0].tm;
+        heap_remove(tm);
+        if (!*tm->woken)
+        {
+            *tm->woken = LWP_WOKEN_TIMER;
+            lwp_unpark(tm->t);
+            woken++;
+        }
+    }
+    // Only now, with the sleepers runnable, stop counting them as
+    // armed; an idle worker must never see them as neither
+    heap_publish();
+    lwp_unlock();
+    return woken;
+}
+
+// ------------ SLEEP --------------
+
+/**
+ * @brief Parks the calling LWP until CLOCK_MONOTONIC (see lwp_now())
+ * reaches abs_ns. A deadline that's already passed just yields, but
+ * still ends the LWP's job as blocking would, so an overrun periodic
+ * loop gets its misses counted and its deadline moved on.
+ */
+void lwp_sleep_until(unsigned long long abs_ns)
+{
+    struct { int woken; lwp_timer tm; } local, *sl;
+
+    if (abs_ns <= lwp_now())
+    {
+        lwp_job_end();
+        return;
+    }
+
+    local.woken = 0;
+    local.tm = (lwp_timer){ abs_ns, lwp_self(), NULL, 0 };
+    sl = lwp_park_mem(&local, sizeof(local));
+    if (sl)
+    {
+        sl->tm.woken = &sl->woken;
+    }
+
+    lwp_lock();
+    if (!sl || lwp_timer_add(&sl->tm) != 0)
+    {
+        // No room to wait properly: let everyone else run meanwhile
+        lwp_unlock();
+        if (sl)
+        {
+            lwp_park_mem_done(&local, sl, sizeof(local));
+        }
+        while (lwp_now() < abs_ns)
+        {
+            lwp_yield();
+        }
+        return;
+    }
+    lwp_park();
+    lwp_park_mem_done(&local, sl, sizeof(local));
+}
+
+/**
+ * @brief Parks the calling LWP for ns nanoseconds
+ */
+void lwp_sleep(unsigned long long ns)
+{
+    lwp_sleep_until(lwp_now() + ns);
+}
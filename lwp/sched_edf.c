@@ -0,0 +1,261 @@
+#include "lwp.h"
+#include "schedulers.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Earliest deadline first. Runnable threads sit in a binary min-heap
+ * keyed on their lwp_set_deadline() deadline, so a thread with a
+ * deadline runs until it blocks or an earlier one becomes runnable.
+ * Threads without one are keyed above any real deadline, from a
+ * counter bumped each time one is picked, so they share what's left
+ * round robin. Keys live in the heap array; a thread's slot is kept
+ * in sched_idx.
+ *
+ * A job ends when the running thread blocks, exits, or sleeps until a
+ * time that's already past, which the library tells us through the
+ * job_end hook. That's when misses are counted and periodic deadlines
+ * move on, like SCHED_DEADLINE's yield.
+ */
+
+#define BG_KEY_BASE (1ULL << 63)    // past any lwp_now() deadline
+
+typedef struct {
+    unsigned long long key;
+    thread             t;
+} edf_ent;
+
+typedef struct {
+    edf_ent            *heap;
+    size_t             len;
+    size_t             cap;
+    unsigned long long bg_seq;      // next background key
+} edf_pool;
+
+// One pool per kernel thread, like the round robin one
+static __thread edf_pool pool;
+
+static void edf_init(void)
+{
+    memset(&pool, 0, sizeof(pool));
+}
+
+static void edf_shutdown(void)
+{
+    free(pool.heap);
+    memset(&pool, 0, sizeof(pool));
+}
+
+// ------------ HEAP --------------
+
+static void heap_set(size_t i, edf_ent e)
+{
+    pool.heap[i] = e;
+    e.t->sched_idx = i;
+}
+
+static void sift_up(size_t i)
+{
+    edf_ent e = pool.heap[i];
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (pool.heap[parent].key <= e.key)
+        {
+            break;
+        }
+        heap_set(i, pool.heap[parent]);
+        i = parent;
+    }
+    heap_set(i, e);
+}
+
+static void sift_down(size_t i)
+{
+    edf_ent e = pool.heap[i];
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= pool.len)
+        {
+            break;
+        }
+        if (child + 1 < pool.len &&
+            pool.heap[child + 1].key < pool.heap[child].key)
+        {
+            child++;
+        }
+        if (e.key <= pool.heap[child].key)
+        {
+            break;
+        }
+        heap_set(i, pool.heap[child]);
+        i = child;
+    }
+    heap_set(i, e);
+}
+
+/**
+ * @brief Whether t is in this pool's heap
+ */
+static int queued(thread t)
+{
+    return t->sched_idx < pool.len && pool.heap[t->sched_idx].t == t;
+}
+
+/**
+ * @brief Takes t out of the heap
+ */
+static void heap_delete(thread t)
+{
+    size_t i = t->sched_idx;
+    edf_ent last = pool.heap[--pool.len];
+    if (last.t != t)
+    {
+        heap_set(i, last);
+        if (i > 0 && pool.heap[(i - 1) / 2].key > last.key)
+        {
+            sift_up(i);
+        }
+        else
+        {
+            sift_down(i);
+        }
+    }
+    t->sched_idx = (size_t)-1;
+}
+
+// ------------ SCHEDULER --------------
+
+/**
+ * @brief The running thread's job is over. Counts a miss if that's
+ * past the deadline, then moves a periodic deadline on to the first
+ * one still ahead, or clears a one-off.
+ */
+static void job_end(thread t)
+{
+    if (!t->deadline)
+    {
+        return;
+    }
+    unsigned long long now = lwp_now();
+    if (now > t->deadline)
+    {
+        t->deadline_misses++;
+    }
+    if (!t->period)
+    {
+        t->deadline = 0;
+        return;
+    }
+    do
+    {
+        t->deadline += t->period;
+    } while (t->deadline <= now);
+}
+
+static void edf_admit(thread t)
+{
+    if (!t || LWPSTATE(t->status) != LWP_LIVE)
+    {
+        return;
+    }
+    if (pool.len == pool.cap)
+    {
+        size_t cap = pool.cap ? pool.cap * 2 : 64;
+        edf_ent *h = realloc(pool.heap, cap * sizeof(*h));
+        if (!h)
+        {
+            // Dropping a runnable thread would lose it for good
+            perror("realloc() edf heap");
+            exit(1);
+        }
+        pool.heap = h;
+        pool.cap = cap;
+    }
+
+    edf_ent e = { t->deadline ? t->deadline : BG_KEY_BASE + pool.bg_seq++,
+                  t };
+    heap_set(pool.len++, e);
+    sift_up(pool.len - 1);
+}
+
+/**
+ * @brief Takes a thread out of the pool. A thread that isn't in the
+ * pool is left alone.
+ */
+static void edf_remove(thread t)
+{
+    if (!t || !queued(t))
+    {
+        return;
+    }
+    heap_delete(t);
+}
+
+/**
+ * @brief Picks the earliest deadline. A background pick gets a fresh
+ * key, which sends it behind the other background threads.
+ * @return The thread, or NULL if nothing is runnable
+ */
+static thread edf_next(void)
+{
+    while (pool.len)
+    {
+        thread chosen = pool.heap[0].t;
+
+        // Clean up dead threads
+        if (LWPSTATE(chosen->status) != LWP_LIVE)
+        {
+            heap_delete(chosen);
+            continue;
+        }
+
+        if (pool.heap[0].key >= BG_KEY_BASE)
+        {
+            pool.heap[0].key = BG_KEY_BASE + pool.bg_seq++;
+            sift_down(0);
+        }
+        return chosen;
+    }
+    return NULL;
+}
+
+static int edf_qlen(void)
+{
+    return (int)pool.len;
+}
+
+/**
+ * @brief The thread's deadline changed: rekeys it if it's queued here
+ */
+static void edf_requeue(thread t)
+{
+    if (queued(t))
+    {
+        heap_delete(t);
+        edf_admit(t);
+    }
+}
+
+/**
+ * @brief job_end hook. A thread that ends its job without blocking is
+ * still queued, so it's rekeyed on its new deadline.
+ */
+static void edf_job_end(thread t)
+{
+    job_end(t);
+    edf_requeue(t);
+}
+
+struct scheduler edf_vtable = {
+    .init = edf_init,
+    .shutdown = edf_shutdown,
+    .admit = edf_admit,
+    .remove = edf_remove,
+    .next = edf_next,
+    .qlen = edf_qlen,
+    .requeue = edf_requeue,
+    .job_end = edf_job_end
+};
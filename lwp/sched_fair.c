@@ -0,0 +1,322 @@
+#include "lwp.h"
+#include "schedulers.h"
+#include <stdint.h>
+#include <string.h>
+#include <x86intrin.h>
+
+/*
+ * Weighted fair share, after Linux's CFS. Every thread carries a
+ * virtual runtime: the TSC cycles it actually ran, scaled down by its
+ * weight. next() charges whoever it picked last time, puts it back
+ * and picks the smallest vruntime, so a thread that burns its whole
+ * turn falls behind one that yields straight away. Weights come from
+ * lwp_set_priority(): each level above LWP_PRIO_DEFAULT is worth 1.25
+ * times the CPU of the one below, like a nice step.
+ *
+ * Runnable threads sit in a pairing heap keyed on vruntime, linked
+ * through sched_one (first child), sched_two (next sibling) and
+ * sched_three (parent if first child, else previous sibling). The one
+ * running is out of the heap, as in CFS.
+ */
+
+#define T_CHILD(t)   ((t)->sched_one)
+#define T_SIBLING(t) ((t)->sched_two)
+#define T_PREV(t)    ((t)->sched_three)
+
+#define NICE_0_WEIGHT (1ULL << 20)  // weight at LWP_PRIO_DEFAULT
+
+typedef struct {
+    thread   root;              // heap of runnable, not running
+    thread   curr;              // last pick, charged on the next one
+    uint64_t since;             // TSC when curr was picked
+    uint64_t min_vruntime;      // never goes backwards
+    size_t   num_threads;       // heap + curr
+} fair_pool;
+
+static __thread fair_pool pool;
+static uint64_t prio_weight[LWP_PRIO_LEVELS];
+
+/**
+ * @brief Fills in the weights once, before any worker can use them:
+ * 1.25x per level out from the default, in integer steps
+ */
+static void __attribute__((constructor)) fair_weights(void)
+{
+    prio_weight[LWP_PRIO_DEFAULT] = NICE_0_WEIGHT;
+    for (int p = LWP_PRIO_DEFAULT + 1; p <= LWP_PRIO_MAX; p++)
+    {
+        prio_weight[p] = prio_weight[p - 1] * 5 / 4;
+    }
+    for (int p = LWP_PRIO_DEFAULT - 1; p >= LWP_PRIO_MIN; p--)
+    {
+        prio_weight[p] = prio_weight[p + 1] * 4 / 5;
+    }
+}
+
+static void fair_init(void)
+{
+    memset(&pool, 0, sizeof(pool));
+}
+
+static void fair_shutdown(void)
+{
+    memset(&pool, 0, sizeof(pool));
+}
+
+// ------------ PAIRING HEAP --------------
+
+/**
+ * @brief Joins two heap roots; the larger becomes the smaller's first
+ * child
+ */
+static thread meld(thread a, thread b)
+{
+    if (b->vruntime < a->vruntime)
+    {
+        thread tmp = a;
+        a = b;
+        b = tmp;
+    }
+    T_PREV(b) = a;
+    T_SIBLING(b) = T_CHILD(a);
+    if (T_CHILD(a))
+    {
+        T_PREV(T_CHILD(a)) = b;
+    }
+    T_CHILD(a) = b;
+    return a;
+}
+
+/**
+ * @brief Standard two-pass merge of a sibling list into one heap:
+ * meld pairs left to right, then fold the results right to left
+ */
+static thread merge_pairs(thread first)
+{
+    thread pairs = NULL;        // melded pairs, stacked via sibling
+
+    while (first)
+    {
+        thread a = first;
+        thread b = T_SIBLING(a);
+        first = b ? T_SIBLING(b) : NULL;
+        T_SIBLING(a) = T_PREV(a) = NULL;
+        if (b)
+        {
+            T_SIBLING(b) = T_PREV(b) = NULL;
+            a = meld(a, b);
+        }
+        T_SIBLING(a) = pairs;
+        pairs = a;
+    }
+
+    thread root = pairs;
+    if (root)
+    {
+        pairs = T_SIBLING(root);
+        T_SIBLING(root) = NULL;
+    }
+    while (pairs)
+    {
+        thread n = T_SIBLING(pairs);
+        T_SIBLING(pairs) = NULL;
+        root = meld(root, pairs);
+        pairs = n;
+    }
+    return root;
+}
+
+static void heap_insert(thread t)
+{
+    T_CHILD(t) = T_SIBLING(t) = T_PREV(t) = NULL;
+    pool.root = pool.root ? meld(pool.root, t) : t;
+}
+
+static thread heap_pop(void)
+{
+    thread t = pool.root;
+    if (t)
+    {
+        pool.root = merge_pairs(T_CHILD(t));
+        T_CHILD(t) = NULL;
+    }
+    return t;
+}
+
+/**
+ * @brief Takes any thread out of the heap
+ * @return 1 if it was there
+ */
+static int heap_delete(thread t)
+{
+    if (t == pool.root)
+    {
+        heap_pop();
+        return 1;
+    }
+    if (!T_PREV(t))
+    {
+        return 0;   // Not in the heap
+    }
+
+    if (T_CHILD(T_PREV(t)) == t)
+    {
+        T_CHILD(T_PREV(t)) = T_SIBLING(t);
+    }
+    else
+    {
+        T_SIBLING(T_PREV(t)) = T_SIBLING(t);
+    }
+    if (T_SIBLING(t))
+    {
+        T_PREV(T_SIBLING(t)) = T_PREV(t);
+    }
+
+    thread sub = merge_pairs(T_CHILD(t));
+    if (sub)
+    {
+        pool.root = meld(pool.root, sub);
+    }
+    T_CHILD(t) = T_SIBLING(t) = T_PREV(t) = NULL;
+    return 1;
+}
+
+// ------------ SCHEDULER --------------
+
+/**
+ * @brief Adds the cycles curr ran since it was picked to its
+ * vruntime, scaled by its weight
+ */
+static void charge_curr(uint64_t now)
+{
+    thread t = pool.curr;
+    int p = t->prio;
+    if (p < LWP_PRIO_MIN)
+    {
+        p = LWP_PRIO_MIN;
+    }
+    else if (p > LWP_PRIO_MAX)
+    {
+        p = LWP_PRIO_MAX;
+    }
+    uint64_t ran = now - pool.since;
+    t->vruntime += (uint64_t)((unsigned __int128)ran * NICE_0_WEIGHT /
+                              prio_weight[p]);
+}
+
+/**
+ * @brief Makes a thread runnable. Newcomers and threads back from
+ * blocking start no earlier than the pool's min_vruntime, so time
+ * spent away doesn't turn into a burst of CPU on return.
+ */
+static void fair_admit(thread t)
+{
+    if (!t || LWPSTATE(t->status) != LWP_LIVE)
+    {
+        return;
+    }
+    if (t->vruntime < pool.min_vruntime)
+    {
+        t->vruntime = pool.min_vruntime;
+    }
+    heap_insert(t);
+    pool.num_threads++;
+}
+
+/**
+ * @brief Takes a thread out of the pool, charging it first if it's
+ * the one running. A thread that isn't in the pool is left alone.
+ */
+static void fair_remove(thread t)
+{
+    if (!t)
+    {
+        return;
+    }
+    if (t == pool.curr)
+    {
+        charge_curr(__rdtsc());
+        pool.curr = NULL;
+        pool.num_threads--;
+    }
+    else if (heap_delete(t))
+    {
+        pool.num_threads--;
+    }
+}
+
+/**
+ * @brief Charges and requeues the last pick, then picks the thread
+ * with the least vruntime
+ * @return The thread, or NULL if nothing is runnable
+ */
+static thread fair_next(void)
+{
+    uint64_t now = __rdtsc();
+
+    if (pool.curr)
+    {
+        charge_curr(now);
+        heap_insert(pool.curr);
+        pool.curr = NULL;
+    }
+
+    thread t;
+    while ((t = heap_pop()) != NULL)
+    {
+        if (LWPSTATE(t->status) == LWP_LIVE)
+        {
+            break;
+        }
+        pool.num_threads--;     // Clean up dead threads
+    }
+    if (!t)
+    {
+        return NULL;
+    }
+
+    if (t->vruntime > pool.min_vruntime)
+    {
+        pool.min_vruntime = t->vruntime;
+    }
+    pool.curr = t;
+    pool.since = now;
+    return t;
+}
+
+static int fair_qlen(void)
+{
+    return (int)pool.num_threads;
+}
+
+/**
+ * @brief lwp_yield_to() is switching to t without asking next():
+ * charges the last pick as next() would and makes t the one running,
+ * so its time gets charged to it
+ */
+static void fair_handoff(thread t)
+{
+    uint64_t now = __rdtsc();
+
+    if (pool.curr)
+    {
+        charge_curr(now);
+        heap_insert(pool.curr);
+        pool.curr = NULL;
+    }
+    if (heap_delete(t))
+    {
+        pool.curr = t;
+        pool.since = now;
+    }
+}
+
+struct scheduler fair_vtable = {
+    .init = fair_init,
+    .shutdown = fair_shutdown,
+    .admit = fair_admit,
+    .remove = fair_remove,
+    .next = fair_next,
+    .qlen = fair_qlen,
+    .handoff = fair_handoff
+};
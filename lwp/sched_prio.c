@@ -0,0 +1,195 @@
+#include "lwp.h"
+#include "schedulers.h"
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Strict priority scheduling: one FIFO per level, round robin within
+ * a level, and a bitmap of the non-empty levels. Level p is bit
+ * LWP_PRIO_MAX - p, so the lowest set bit is the highest priority and
+ * picking it is one ctz. Like rr_vtable, the running thread stays
+ * queued and next() rotates it to the back of its level.
+ */
+
+#define T_NEXT(t) ((t)->sched_one)
+#define T_PREV(t) ((t)->sched_two)
+#define LEVEL_BIT(p) (1ULL << (LWP_PRIO_MAX - (p)))
+
+typedef struct {
+    thread   head[LWP_PRIO_LEVELS];
+    thread   tail[LWP_PRIO_LEVELS];
+    uint64_t nonempty;          // LEVEL_BIT(p) set: head[p] != NULL
+    size_t   num_threads;
+} prio_pool;
+
+// One pool per kernel thread, like the round robin one
+static __thread prio_pool pool;
+
+static void prio_init(void)
+{
+    memset(&pool, 0, sizeof(pool));
+}
+
+static void prio_shutdown(void)
+{
+    memset(&pool, 0, sizeof(pool));
+}
+
+/**
+ * @brief Queues a thread on its priority's level, at the back or, for
+ * one that should go before its peers, at the front
+ */
+static void prio_enqueue(thread t, int front)
+{
+    if (!t || LWPSTATE(t->status) != LWP_LIVE)
+    {
+        return;
+    }
+
+    int p = t->prio;
+    if (p < LWP_PRIO_MIN)
+    {
+        p = LWP_PRIO_MIN;
+    }
+    else if (p > LWP_PRIO_MAX)
+    {
+        p = LWP_PRIO_MAX;
+    }
+    t->sched_prio = p;          // prio may change while we hold it
+
+    if (!pool.head[p])
+    {
+        T_NEXT(t) = T_PREV(t) = NULL;
+        pool.head[p] = pool.tail[p] = t;
+        pool.nonempty |= LEVEL_BIT(p);
+    }
+    else if (front)
+    {
+        T_NEXT(t) = pool.head[p];
+        T_PREV(t) = NULL;
+        T_PREV(pool.head[p]) = t;
+        pool.head[p] = t;
+    }
+    else
+    {
+        T_NEXT(t) = NULL;
+        T_PREV(t) = pool.tail[p];
+        T_NEXT(pool.tail[p]) = t;
+        pool.tail[p] = t;
+    }
+    pool.num_threads++;
+}
+
+static void prio_admit(thread t)
+{
+    prio_enqueue(t, 0);
+}
+
+static void prio_readmit(thread t)
+{
+    prio_enqueue(t, 1);
+}
+
+/**
+ * @brief Unlinks a thread from the level it was queued at. A thread
+ * that isn't queued is left alone.
+ */
+static void prio_remove(thread t)
+{
+    if (!t)
+    {
+        return;
+    }
+
+    int p = t->sched_prio;
+    if (T_PREV(t))
+    {
+        T_NEXT(T_PREV(t)) = T_NEXT(t);
+    }
+    else if (pool.head[p] == t)
+    {
+        pool.head[p] = T_NEXT(t);
+    }
+    else
+    {
+        return;     // Not in the pool
+    }
+
+    if (T_NEXT(t))
+    {
+        T_PREV(T_NEXT(t)) = T_PREV(t);
+    }
+    else
+    {
+        pool.tail[p] = T_PREV(t);
+    }
+    if (!pool.head[p])
+    {
+        pool.nonempty &= ~LEVEL_BIT(p);
+    }
+    T_NEXT(t) = NULL;
+    T_PREV(t) = NULL;
+    pool.num_threads--;
+}
+
+/**
+ * @brief Picks the head of the highest non-empty level and rotates it
+ * to the back of that level
+ * @return The thread, or NULL if nothing is queued
+ */
+static thread prio_next(void)
+{
+    while (pool.nonempty)
+    {
+        int p = LWP_PRIO_MAX - __builtin_ctzll(pool.nonempty);
+        thread chosen = pool.head[p];
+
+        // Clean up dead threads
+        if (LWPSTATE(chosen->status) != LWP_LIVE)
+        {
+            prio_remove(chosen);
+            continue;
+        }
+
+        if (chosen != pool.tail[p])
+        {
+            pool.head[p] = T_NEXT(chosen);
+            T_PREV(pool.head[p]) = NULL;
+            T_NEXT(chosen) = NULL;
+            T_PREV(chosen) = pool.tail[p];
+            T_NEXT(pool.tail[p]) = chosen;
+            pool.tail[p] = chosen;
+        }
+        return chosen;
+    }
+    return NULL;
+}
+
+static int prio_qlen(void)
+{
+    return (int)pool.num_threads;
+}
+
+/**
+ * @brief The thread's priority changed: moves it to the back of its
+ * new level if it's queued here
+ */
+static void prio_requeue(thread t)
+{
+    if (T_PREV(t) || pool.head[t->sched_prio] == t)
+    {
+        prio_remove(t);     // from sched_prio, the old level
+        prio_admit(t);
+    }
+}
+
+struct scheduler prio_vtable = {
+    .init = prio_init,
+    .shutdown = prio_shutdown,
+    .admit = prio_admit,
+    .remove = prio_remove,
+    .next = prio_next,
+    .qlen = prio_qlen,
+    .requeue = prio_requeue,
+    .readmit = prio_readmit
+};
@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #define T_NEXT(t) ((t)->sched_one) // Macro to get the next thread pointer
+#define T_PREV(t) ((t)->sched_two) // and the previous one
 
 typedef struct{
     thread head;
@@ -16,11 +17,13 @@ struct scheduler rr_vtable = {
     .admit = admit,
     .remove = pool_remove,
     .next = next,
-    .qlen = qlen
+    .qlen = qlen,
+    .readmit = readmit
 };
 
-// Global vars
-static thread_pool pool;
+// Global vars, one pool per kernel thread so each M:N worker has
+// its own run queue
+static __thread thread_pool pool;
 
 /**
  * @brief Inits the thread pool 
@@ -61,6 +64,7 @@ void admit(thread new_thread)
     
     // Add to the end of the list
     T_NEXT(new_thread) = NULL;
+    T_PREV(new_thread) = pool.tail;
     if (pool.tail) 
     {
         T_NEXT(pool.tail) = new_thread;
@@ -73,11 +77,38 @@ void admit(thread new_thread)
     pool.num_threads++;
 }
 
+/**
+ * @brief Puts a thread back at the head of the pool, so next() picks
+ * it before the threads that were already waiting
+ * @param t thread to add into the pool
+ */
+void readmit(thread t)
+{
+    if (!t || LWPSTATE(t->status) != LWP_LIVE)
+    {
+        return;
+    }
+
+    T_PREV(t) = NULL;
+    T_NEXT(t) = pool.head;
+    if (pool.head)
+    {
+        T_PREV(pool.head) = t;
+    }
+    else
+    {
+        pool.tail = t;
+    }
+    pool.head = t;
+    pool.num_threads++;
+}
+
 /**
  * @brief Removes specific thread from round robin pool
  * 
- * Searches the pool's linked list for the vimtim thread and 
- * unlinks it, updating head/tail pointers as needed.
+ * The pool is doubly linked (sched_one forward, sched_two back), so
+ * the victim is unlinked in place without walking the list. A thread
+ * that isn't in the pool is left alone.
  * 
  * @param victim The thread to remove from the scheduling pool
  */
@@ -88,38 +119,33 @@ void pool_remove(thread victim)
         return;
     }
 
-    thread prev = NULL;
-    thread curr = pool.head;
-
-    // Walk the list to find the victimk
-    while(curr)
-    {
-        if (curr == victim)
-        {
-            // Unlink from the list
-            if (prev)
-            {
-                T_NEXT(prev) = T_NEXT(curr);
-            }
-            else
-            {
-                pool.head = T_NEXT(curr); // Victim was head
-            }
-            
-            // Update tail if we removed the last node
-            if (pool.tail == curr) 
-            {
-                pool.tail = prev;
-            }
-
-            // Clean up and decrement count
-            T_NEXT(curr) = NULL;
-            pool.num_threads--;
-            return;
-        }
-        prev = curr;
-        curr = T_NEXT(curr);
+    if (T_PREV(victim))
+    {
+        T_NEXT(T_PREV(victim)) = T_NEXT(victim);
+    }
+    else if (pool.head == victim)
+    {
+        pool.head = T_NEXT(victim); // Victim was head
+    }
+    else
+    {
+        return; // Not in the pool
+    }
+
+    // Update tail if we removed the last node
+    if (T_NEXT(victim))
+    {
+        T_PREV(T_NEXT(victim)) = T_PREV(victim);
     }
+    else
+    {
+        pool.tail = T_PREV(victim);
+    }
+
+    // Clean up and decrement count
+    T_NEXT(victim) = NULL;
+    T_PREV(victim) = NULL;
+    pool.num_threads--;
 }
 
 /**
@@ -154,7 +180,9 @@ thread next(void) {
     {     // rotate AFTER choosing
         thread old = pool.head;
         pool.head = T_NEXT(old);
+        T_PREV(pool.head) = NULL;
         T_NEXT(old) = NULL;
+        T_PREV(old) = pool.tail;
         T_NEXT(pool.tail) = old;
         pool.tail = old;
     }
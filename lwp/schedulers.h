@@ -8,6 +8,9 @@ extern scheduler ChooseHighestColor;
 extern scheduler ChooseLowestColor;
 
 extern struct scheduler rr_vtable;
+extern struct scheduler prio_vtable;  /* lwp_set_priority() levels */
+extern struct scheduler fair_vtable;  /* CFS-style weighted share  */
+extern struct scheduler edf_vtable;   /* earliest deadline first   */
 
 #define LWPSTATE(stat)           (((stat) >> 8) & 0xFF)
 
@@ -17,6 +20,7 @@ void   admit(thread new);     /* add a thread to the pool      */
 void   pool_remove(thread victim); /* remove a thread from the pool */
 thread next(void);            /* select a thread to schedule   */
 int    qlen(void);            /* number of ready threads       */
+void   readmit(thread t);     /* add one back at the front     */
 
 #endif
 
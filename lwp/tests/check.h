@@ -0,0 +1,47 @@
+/*
+ * Shared by the tests.  CHECK() reports and counts a failure; a test
+ * passes if it reaches test_done() with none.  Ending any other way,
+ * e.g. the library exiting because every LWP is parked, is a failure.
+ */
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const char *test_name = "";
+static int test_fails = 0;
+static int test_finished = 0;
+
+#define CHECK(cond) do {                                            \
+        if (!(cond)) {                                              \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n",            \
+                    __FILE__, __LINE__, #cond);                     \
+            __atomic_add_fetch(&test_fails, 1, __ATOMIC_RELAXED);   \
+        }                                                           \
+    } while (0)
+
+static void test_atexit(void)
+{
+    if (!test_finished) {
+        fprintf(stderr, "%s: FAIL (exited before finishing)\n", test_name);
+        _exit(1);
+    }
+}
+
+static void test_begin(const char *name)
+{
+    test_name = name;
+    atexit(test_atexit);
+}
+
+static int test_done(void)
+{
+    test_finished = 1;
+    printf("%s: %s\n", test_name, test_fails ? "FAIL" : "PASS");
+    fflush(stdout);
+    return test_fails != 0;
+}
+
+#endif
@@ -0,0 +1,117 @@
+/* Channels on 4 workers: producers and consumers over unbuffered,
+ * buffered and unbounded channels, then select over two channels.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+
+#define WORKERS   4
+#define PRODUCERS 8
+#define CONSUMERS 4
+#define PER       2000
+
+static lwp_chan *ch, *a, *b;
+static long sum_recv, n_recv;
+
+static int producer(void *arg)
+{
+    long id = (long)(intptr_t)arg;
+    for (long i = 1; i <= PER; i++) {
+        CHECK(lwp_chan_send(ch, (void *)(intptr_t)(id * PER + i)) == 0);
+        if (i % 64 == 0)
+            lwp_yield();
+    }
+    return 0;
+}
+
+static int consumer(void *arg)
+{
+    (void)arg;
+    void *v;
+    while (lwp_chan_recv(ch, &v) == 0) {
+        __atomic_add_fetch(&sum_recv, (long)(intptr_t)v, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&n_recv, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void run(size_t cap)
+{
+    long expect = 0;
+    ch = lwp_chan_create(cap);
+    sum_recv = n_recv = 0;
+
+    for (long c = 0; c < CONSUMERS; c++)
+        lwp_create(consumer, NULL);
+    for (long p = 0; p < PRODUCERS; p++) {
+        lwp_create(producer, (void *)(intptr_t)p);
+        for (long i = 1; i <= PER; i++)
+            expect += p * PER + i;
+    }
+
+    /* Consumers only finish once the channel is closed */
+    for (int i = 0; i < PRODUCERS; i++)
+        lwp_wait(NULL);
+    CHECK(lwp_chan_close(ch) == 0);
+    CHECK(lwp_chan_close(ch) == -1);
+    for (int i = 0; i < CONSUMERS; i++)
+        lwp_wait(NULL);
+
+    CHECK(n_recv == PRODUCERS * PER);
+    CHECK(sum_recv == expect);
+    CHECK(lwp_chan_send(ch, NULL) == -1);
+    lwp_chan_destroy(ch);
+}
+
+static int sender(void *arg)
+{
+    lwp_chan *c = arg;
+    for (long i = 1; i <= PER; i++)
+        lwp_chan_send(c, (void *)(intptr_t)i);
+    return 0;
+}
+
+static int selector(void *arg)
+{
+    (void)arg;
+    long got[2] = {0, 0};
+    lwp_chan_case cs[2] = {
+        { a, LWP_CHAN_RECV, NULL, 0 },
+        { b, LWP_CHAN_RECV, NULL, 0 },
+    };
+    for (int n = 0; n < 2 * PER; n++) {
+        int i = lwp_chan_select(cs, 2, 1);
+        CHECK(i == 0 || i == 1);
+        if (i == 0 || i == 1) {
+            CHECK(cs[i].ok);
+            got[i] += (long)(intptr_t)cs[i].val;
+        }
+    }
+    CHECK(got[0] == (long)PER * (PER + 1) / 2);
+    CHECK(got[1] == (long)PER * (PER + 1) / 2);
+    CHECK(lwp_chan_select(cs, 2, 0) == -1);     /* nothing left */
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_chan");
+    lwp_set_workers(WORKERS);
+    lwp_start();
+
+    run(0);
+    run(8);
+    run(LWP_CHAN_UNBOUNDED);
+
+    a = lwp_chan_create(0);
+    b = lwp_chan_create(4);
+    lwp_create(selector, NULL);
+    lwp_create(sender, a);
+    lwp_create(sender, b);
+    for (int i = 0; i < 3; i++)
+        lwp_wait(NULL);
+    lwp_chan_destroy(a);
+    lwp_chan_destroy(b);
+
+    return test_done();
+}
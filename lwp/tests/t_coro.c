@@ -0,0 +1,71 @@
+/* Coroutines on 4 workers: generators whose LWPs yield, and so move
+ * between kernel threads, in between resumes and inside the
+ * coroutine itself, plus one coroutine resuming another.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+
+#define WORKERS 4
+#define THREADS 16
+#define COUNT   500
+
+static void *counter(void *arg)
+{
+    intptr_t n = (intptr_t)arg;
+    for (intptr_t i = 1; i <= n; i++) {
+        if (i % 8 == 0)
+            lwp_yield();            /* with the coroutine running */
+        CHECK(lwp_coro_yield((void *)i) == (void *)(i * 10));
+    }
+    return (void *)-1;
+}
+
+/* Doubles what an inner counter produces */
+static void *doubler(void *arg)
+{
+    lwp_coro *inner = lwp_coro_create(counter, arg, 0);
+    intptr_t i = 1;
+    void *v = lwp_coro_resume(inner, NULL);
+    while (!lwp_coro_done(inner)) {
+        lwp_coro_yield((void *)((intptr_t)v * 2));
+        v = lwp_coro_resume(inner, (void *)(i++ * 10));
+    }
+    lwp_coro_destroy(inner);
+    return (void *)-2;
+}
+
+static int worker(void *arg)
+{
+    int nested = (int)(intptr_t)arg;
+    lwp_coro *co = lwp_coro_create(nested ? doubler : counter,
+                                   (void *)(intptr_t)COUNT, 0);
+    CHECK(co != NULL);
+    CHECK(lwp_coro_yield(NULL) == NULL);    /* not in a coroutine */
+
+    void *v = lwp_coro_resume(co, NULL);
+    for (intptr_t i = 1; i <= COUNT; i++) {
+        CHECK(v == (void *)(nested ? 2 * i : i));
+        lwp_yield();
+        v = lwp_coro_resume(co, nested ? NULL : (void *)(i * 10));
+    }
+    CHECK(lwp_coro_done(co));
+    CHECK(v == (void *)(intptr_t)(nested ? -2 : -1));
+    CHECK(lwp_coro_resume(co, NULL) == NULL);
+    lwp_coro_destroy(co);
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_coro");
+    lwp_set_workers(WORKERS);
+    lwp_start();
+
+    for (int i = 0; i < THREADS; i++)
+        lwp_create(worker, (void *)(intptr_t)(i & 1));
+    for (int i = 0; i < THREADS; i++)
+        lwp_wait(NULL);
+
+    return test_done();
+}
@@ -0,0 +1,81 @@
+/* EDF deadline misses: a periodic loop that overruns its period has
+ * every late job counted and its deadline moved past the overrun,
+ * even though its catch-up sleeps are already due and never block;
+ * one with plenty of slack misses nothing.  Moving threads between
+ * schedulers ends nobody's job.
+ */
+#include "lwp.h"
+#include "schedulers.h"
+#include "check.h"
+
+#define MS      1000000ULL
+#define JOBS    3
+
+static void spin_until(unsigned long long t)
+{
+    while (lwp_now() < t)
+        ;
+}
+
+/* next += period; lwp_sleep_until(next), the usual periodic loop */
+static int periodic(void *arg)
+{
+    unsigned long long period = (unsigned long long)(long)arg * MS;
+    unsigned long long work = period > 10 * MS ? 0 : 20 * MS;
+    thread me = tid2thread(lwp_gettid());
+    unsigned long long next = lwp_now();
+
+    lwp_set_deadline(lwp_gettid(), next + period, period);
+    for (int i = 0; i < JOBS; i++) {
+        spin_until(lwp_now() + work);
+        next += period;
+        unsigned long long before = lwp_now();
+        lwp_sleep_until(next);
+        /* The deadline ahead of the job just started, not behind */
+        CHECK(me->deadline > before);
+    }
+    return (int)lwp_get_deadline_misses(lwp_gettid());
+}
+
+/* Off EDF and back, twice: the deadline mustn't move */
+static int switcher(void *arg)
+{
+    thread me = tid2thread(lwp_gettid());
+    unsigned long long deadline = lwp_now() + 1000 * MS;
+    (void)arg;
+
+    lwp_set_deadline(lwp_gettid(), deadline, 1000 * MS);
+    for (int i = 0; i < 2; i++) {
+        lwp_set_scheduler(&rr_vtable);
+        lwp_yield();
+        lwp_set_scheduler(&edf_vtable);
+        lwp_yield();
+    }
+    CHECK(me->deadline == deadline);
+    return (int)lwp_get_deadline_misses(lwp_gettid());
+}
+
+int main(void)
+{
+    int status;
+
+    test_begin("t_edf");
+    lwp_set_scheduler(&edf_vtable);
+    lwp_start();
+
+    /* 20 ms of work against a 2 ms period: every job is late */
+    tid_t late = lwp_create(periodic, (void *)2L);
+    CHECK(lwp_wait(&status) == late);
+    CHECK(LWPTERMSTAT(status) == JOBS);
+
+    /* No work against 50 ms: never late */
+    tid_t ok = lwp_create(periodic, (void *)50L);
+    CHECK(lwp_wait(&status) == ok);
+    CHECK(LWPTERMSTAT(status) == 0);
+
+    tid_t sw = lwp_create(switcher, NULL);
+    CHECK(lwp_wait(&status) == sw);
+    CHECK(LWPTERMSTAT(status) == 0);
+
+    return test_done();
+}
@@ -0,0 +1,51 @@
+/* Weighted fair share: two CPU-bound LWPs four levels apart get CPU
+ * in proportion to their weights (1.25^4, about 2.44), within a loose
+ * bound for a noisy machine.
+ */
+#include "lwp.h"
+#include "schedulers.h"
+#include "check.h"
+#include <stdint.h>
+
+#define STEPS    4
+#define RUN_NS   (300 * 1000 * 1000ULL)
+#define CHUNK    20000
+
+static volatile long chunks[2];
+static volatile int stop;
+
+static int spinner(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    while (!stop) {
+        for (volatile int i = 0; i < CHUNK; i++)
+            ;
+        chunks[id]++;
+        lwp_yield();
+    }
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_fair");
+    lwp_set_scheduler(&fair_vtable);
+    lwp_start();
+
+    tid_t lo = lwp_create(spinner, (void *)0);
+    tid_t hi = lwp_create(spinner, (void *)1);
+    CHECK(lwp_set_priority(lo, LWP_PRIO_DEFAULT) == 0);
+    CHECK(lwp_set_priority(hi, LWP_PRIO_DEFAULT + STEPS) == 0);
+    lwp_sleep(RUN_NS);
+    stop = 1;
+    lwp_wait(NULL);
+    lwp_wait(NULL);
+
+    double ratio = (double)chunks[1] / (chunks[0] ? chunks[0] : 1);
+    CHECK(chunks[0] > 0);
+    CHECK(ratio > 1.8 && ratio < 3.3);
+    if (test_fails)
+        fprintf(stderr, "t_fair: %ld vs %ld chunks\n", chunks[1], chunks[0]);
+
+    return test_done();
+}
@@ -0,0 +1,91 @@
+/* I/O that parks only its caller: a read on an empty pipe lets the
+ * other LWPs keep running, a write wakes it, and with nothing else
+ * runnable the worker waits in epoll for a kernel thread's write
+ * instead of exiting.  Then lwp_poll() readiness and timeouts.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <pthread.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+
+#define TICKS 100
+
+static int p[2];
+static volatile int ticks;
+static volatile int got;
+
+static int reader(void *arg)
+{
+    char buf[8];
+    (void)arg;
+    CHECK(lwp_read(p[0], buf, sizeof(buf)) == 5);
+    CHECK(memcmp(buf, "hello", 5) == 0);
+    CHECK(ticks == TICKS);      /* it waited for the write below */
+    got = 1;
+    return 0;
+}
+
+static int ticker(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < TICKS; i++) {
+        CHECK(!got);
+        ticks++;
+        lwp_yield();
+    }
+    CHECK(lwp_write(p[1], "hello", 5) == 5);
+    return 0;
+}
+
+static void *late_writer(void *arg)
+{
+    struct timespec ts = {0, 20 * 1000 * 1000};
+    (void)arg;
+    nanosleep(&ts, NULL);
+    if (write(p[1], "x", 1) != 1)
+        abort();
+    return NULL;
+}
+
+static int lone_reader(void *arg)
+{
+    char c;
+    (void)arg;
+    CHECK(lwp_read(p[0], &c, 1) == 1 && c == 'x');
+    return 0;
+}
+
+int main(void)
+{
+    struct pollfd pfd;
+    pthread_t pt;
+
+    test_begin("t_io");
+    CHECK(pipe(p) == 0);
+    lwp_start();
+
+    lwp_create(reader, NULL);
+    lwp_create(ticker, NULL);
+    lwp_wait(NULL);
+    lwp_wait(NULL);
+    CHECK(got);
+
+    /* Everyone parked on I/O: only epoll can wake the reader */
+    pthread_create(&pt, NULL, late_writer, NULL);
+    lwp_create(lone_reader, NULL);
+    lwp_wait(NULL);
+    pthread_join(pt, NULL);
+
+    pfd.fd = p[0];
+    pfd.events = POLLIN;
+    CHECK(lwp_poll(&pfd, 1, 0) == 0);
+    CHECK(lwp_poll(&pfd, 1, 10) == 0);
+    CHECK(lwp_write(p[1], "y", 1) == 1);
+    CHECK(lwp_poll(&pfd, 1, -1) == 1 && (pfd.revents & POLLIN));
+
+    CHECK(lwp_close(p[0]) == 0);
+    CHECK(lwp_close(p[1]) == 0);
+    return test_done();
+}
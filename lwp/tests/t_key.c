@@ -0,0 +1,76 @@
+/* Per-LWP keys on 2 workers: values stay per LWP across yields and
+ * migrations, destructors run on exit (including values set again
+ * by a destructor), and a deleted key comes back NULL everywhere.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+
+#define WORKERS 2
+#define THREADS 50
+
+static lwp_key_t k_sum, k_again, k_far;
+static long freed, again_runs;
+
+static void add_up(void *v)
+{
+    __atomic_add_fetch(&freed, (long)(intptr_t)v, __ATOMIC_RELAXED);
+}
+
+/* Sets itself again twice more: needs three destructor rounds */
+static void set_again(void *v)
+{
+    __atomic_add_fetch(&again_runs, 1, __ATOMIC_RELAXED);
+    if ((intptr_t)v < 3)
+        lwp_setspecific(k_again, (void *)((intptr_t)v + 1));
+}
+
+static int worker(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    CHECK(lwp_getspecific(k_sum) == NULL);
+    CHECK(lwp_setspecific(k_sum, (void *)id) == 0);
+    CHECK(lwp_setspecific(k_far, (void *)(id * 2)) == 0);
+    for (int i = 0; i < 200; i++) {
+        CHECK(lwp_getspecific(k_sum) == (void *)id);
+        CHECK(lwp_getspecific(k_far) == (void *)(id * 2));
+        lwp_yield();
+    }
+    if (id == 1)
+        lwp_setspecific(k_again, (void *)1);
+    return 0;
+}
+
+int main(void)
+{
+    lwp_key_t filler[LWP_KEYS_INLINE];
+
+    test_begin("t_key");
+    lwp_set_workers(WORKERS);
+    CHECK(lwp_key_create(&k_sum, add_up) == 0);
+    CHECK(lwp_key_create(&k_again, set_again) == 0);
+    /* Push k_far past the slots kept in the context */
+    for (int i = 0; i < LWP_KEYS_INLINE; i++)
+        CHECK(lwp_key_create(&filler[i], NULL) == 0);
+    CHECK(lwp_key_create(&k_far, NULL) == 0);
+    CHECK(k_far >= LWP_KEYS_INLINE);
+    lwp_start();
+
+    for (intptr_t i = 1; i <= THREADS; i++)
+        lwp_create(worker, (void *)i);
+    for (int i = 0; i < THREADS; i++)
+        lwp_wait(NULL);
+    CHECK(freed == (long)THREADS * (THREADS + 1) / 2);
+    CHECK(again_runs == 3);
+
+    /* Ours survives the others exiting; deleting clears it */
+    CHECK(lwp_setspecific(k_sum, (void *)7) == 0);
+    CHECK(lwp_key_delete(k_sum) == 0);
+    CHECK(lwp_key_delete(k_sum) == -1);
+    CHECK(lwp_setspecific(k_sum, (void *)7) == -1);
+    lwp_key_t k;
+    CHECK(lwp_key_create(&k, NULL) == 0);
+    CHECK(lwp_getspecific(k) == NULL);
+
+    return test_done();
+}
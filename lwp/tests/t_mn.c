@@ -0,0 +1,84 @@
+/* M:N on 4 workers: a tree of LWPs that create more of their own,
+ * with yields in between, reaped by main.  Every exit status must
+ * come back exactly once, and the work has to spread past the kernel
+ * thread main started on.  Then busy LWPs that only yield: each gets
+ * a turn before the first is done, spilled or not.
+ */
+#define _GNU_SOURCE
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#define WORKERS 4
+#define FANOUT  4
+#define DEPTH   4
+#define NODES   (1 + 4 + 16 + 64 + 256)
+#define YIELDS  50
+#define BUSY    64
+#define ROUNDS  20000
+
+static pid_t main_ktid;
+static long elsewhere;
+static long turns[BUSY];
+static volatile int stop;
+
+static int node(void *arg)
+{
+    intptr_t depth = (intptr_t)arg;
+
+    for (int i = 0; i < FANOUT && depth > 0; i++) {
+        CHECK(lwp_create(node, (void *)(depth - 1)) != NO_THREAD);
+        lwp_yield();
+    }
+    for (int i = 0; i < YIELDS; i++) {
+        if (syscall(SYS_gettid) != main_ktid)
+            __atomic_add_fetch(&elsewhere, 1, __ATOMIC_RELAXED);
+        lwp_yield();
+    }
+    return depth + 1;
+}
+
+static int busy(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    while (!stop) {
+        if (++turns[id] == ROUNDS)
+            stop = 1;
+        lwp_yield();
+    }
+    return 0;
+}
+
+int main(void)
+{
+    int seen[DEPTH + 2] = {0};
+    int status;
+
+    test_begin("t_mn");
+    main_ktid = syscall(SYS_gettid);
+    CHECK(lwp_set_workers(WORKERS) == 0);
+    CHECK(lwp_set_workers(0) == -1);
+    lwp_start();
+    CHECK(lwp_set_workers(2) == -1);
+
+    CHECK(lwp_create(node, (void *)(intptr_t)DEPTH) != NO_THREAD);
+    for (int i = 0; i < NODES; i++) {
+        CHECK(lwp_wait(&status) != NO_THREAD);
+        CHECK(status >= 1 && status <= DEPTH + 1);
+        seen[status % (DEPTH + 2)]++;
+    }
+    /* 256 leaves down to one root */
+    for (int d = 0, n = 1; d <= DEPTH; d++, n *= FANOUT)
+        CHECK(seen[DEPTH + 1 - d] == n);
+    CHECK(elsewhere > 0);
+
+    for (intptr_t i = 0; i < BUSY; i++)
+        lwp_create(busy, (void *)i);
+    for (int i = 0; i < BUSY; i++)
+        lwp_wait(NULL);
+    for (int i = 0; i < BUSY; i++)
+        CHECK(turns[i] > 0);
+
+    return test_done();
+}
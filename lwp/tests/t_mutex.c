@@ -0,0 +1,102 @@
+/* Mutexes, condition variables and semaphores on 4 workers with
+ * preemption on: a counter only the lock protects, and a bounded
+ * buffer built from a mutex and two conditions.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+
+#define WORKERS 4
+#define LOCKERS 16
+#define ROUNDS  2000
+#define SLOTS   4
+#define ITEMS   5000
+
+static lwp_mutex m = LWP_MUTEX_INITIALIZER;
+static long counter;
+
+static lwp_mutex bm = LWP_MUTEX_INITIALIZER;
+static lwp_cond not_full = LWP_COND_INITIALIZER;
+static lwp_cond not_empty = LWP_COND_INITIALIZER;
+static long buf[SLOTS];
+static int head, len;
+static long consumed;
+
+static lwp_sem done = LWP_SEM_INITIALIZER(0);
+
+static int locker(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        CHECK(lwp_mutex_lock(&m) == 0);
+        long c = counter;
+        if (i % 16 == 0)
+            lwp_yield();            /* others must queue, not barge */
+        counter = c + 1;
+        CHECK(lwp_mutex_unlock(&m) == 0);
+    }
+    lwp_sem_post(&done);
+    return 0;
+}
+
+static int put(void *arg)
+{
+    (void)arg;
+    for (long i = 1; i <= ITEMS; i++) {
+        lwp_mutex_lock(&bm);
+        while (len == SLOTS)
+            lwp_cond_wait(&not_full, &bm);
+        buf[(head + len++) % SLOTS] = i;
+        lwp_cond_signal(&not_empty);
+        lwp_mutex_unlock(&bm);
+    }
+    return 0;
+}
+
+static int take(void *arg)
+{
+    (void)arg;
+    for (long i = 1; i <= ITEMS; i++) {
+        lwp_mutex_lock(&bm);
+        while (len == 0)
+            lwp_cond_wait(&not_empty, &bm);
+        long v = buf[head];
+        head = (head + 1) % SLOTS;
+        len--;
+        lwp_cond_signal(&not_full);
+        lwp_mutex_unlock(&bm);
+        CHECK(v == i);              /* one producer: FIFO order */
+        consumed += v;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_mutex");
+    lwp_set_workers(WORKERS);
+    lwp_set_preempt(200);
+    lwp_start();
+
+    for (int i = 0; i < LOCKERS; i++)
+        lwp_create(locker, NULL);
+    for (int i = 0; i < LOCKERS; i++)
+        lwp_sem_wait(&done);
+    CHECK(lwp_sem_trywait(&done) == -1);
+    for (int i = 0; i < LOCKERS; i++)
+        lwp_wait(NULL);
+    CHECK(counter == (long)LOCKERS * ROUNDS);
+
+    CHECK(lwp_mutex_trylock(&m) == 0);
+    CHECK(lwp_mutex_trylock(&m) != 0);
+    CHECK(lwp_mutex_unlock(&m) == 0);
+    CHECK(lwp_mutex_unlock(&m) == -1);      /* not ours any more */
+
+    lwp_create(take, NULL);
+    lwp_create(put, NULL);
+    lwp_wait(NULL);
+    lwp_wait(NULL);
+    CHECK(consumed == (long)ITEMS * (ITEMS + 1) / 2);
+
+    return test_done();
+}
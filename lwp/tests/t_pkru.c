@@ -0,0 +1,53 @@
+/* Protection keys: a new LWP starts with the PKRU of the kernel
+ * thread it runs on, not the all-access init value, and a switch
+ * doesn't change it.  Passes trivially without OS PKU support.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <cpuid.h>
+
+/* Access disabled for key 15, which no page here uses */
+#define PKRU_TEST (1U << 30)
+
+static unsigned int rdpkru(void)
+{
+    unsigned int eax, edx;
+    __asm__ volatile("rdpkru" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+}
+
+static void wrpkru(unsigned int pkru)
+{
+    __asm__ volatile("wrpkru" : : "a"(pkru), "c"(0), "d"(0) : "memory");
+}
+
+static int child(void *arg)
+{
+    unsigned int want = *(unsigned int *)arg;
+    CHECK(rdpkru() == want);
+    lwp_yield();
+    CHECK(rdpkru() == want);
+    return 0;
+}
+
+int main(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+
+    test_begin("t_pkru");
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) ||
+        !(ecx & bit_OSPKE))
+        return test_done();
+
+    lwp_start();
+    unsigned int pkru = rdpkru() | PKRU_TEST;
+    wrpkru(pkru);
+
+    for (int i = 0; i < 4; i++)
+        lwp_create(child, &pkru);
+    for (int i = 0; i < 4; i++)
+        lwp_wait(NULL);
+    CHECK(rdpkru() == pkru);
+
+    return test_done();
+}
@@ -0,0 +1,81 @@
+/* Timer preemption on one worker: CPU-bound LWPs that never yield
+ * all make progress, and a preempt-disabled section runs to its end
+ * without the others getting a turn.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+#include <time.h>
+
+#define SPINNERS 3
+#define QUANTUM_US 500
+#define QUIET_MS 30
+
+static volatile long spins[SPINNERS];
+static volatile int stop;
+
+static long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static long total(void)
+{
+    long n = 0;
+    for (int i = 0; i < SPINNERS; i++)
+        n += spins[i];
+    return n;
+}
+
+static int spinner(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    while (!stop)
+        spins[id]++;
+    return 0;
+}
+
+/* Never yields: only the timer lets anyone else run */
+static int quiet(void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < SPINNERS; i++)
+        while (spins[i] == 0)
+            ;
+
+    lwp_preempt_disable();
+    long before = total();
+    long long end = now_ms() + QUIET_MS;
+    while (now_ms() < end)
+        ;
+    CHECK(total() == before);
+    lwp_preempt_enable();
+
+    /* Switching again now: wait for each spinner to move on */
+    long seen[SPINNERS];
+    for (int i = 0; i < SPINNERS; i++)
+        seen[i] = spins[i];
+    for (int i = 0; i < SPINNERS; i++)
+        while (spins[i] == seen[i])
+            ;
+    stop = 1;
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_preempt");
+    lwp_start();
+    CHECK(lwp_set_preempt(QUANTUM_US) == 0);
+
+    for (intptr_t i = 0; i < SPINNERS; i++)
+        lwp_create(spinner, (void *)i);
+    lwp_create(quiet, NULL);
+    for (int i = 0; i < SPINNERS + 1; i++)
+        lwp_wait(NULL);
+    CHECK(lwp_set_preempt(0) == 0);
+
+    return test_done();
+}
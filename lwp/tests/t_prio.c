@@ -0,0 +1,81 @@
+/* Strict priority: every LWP at a higher level finishes before a
+ * lower one gets a turn, LWPs on the same level take turns, and
+ * raising a new LWP above its creator runs it at the next yield.
+ */
+#include "lwp.h"
+#include "schedulers.h"
+#include "check.h"
+#include <stdint.h>
+
+#define LEVELS 3
+#define PER    2
+#define ROUNDS 3
+#define RUNS   (LEVELS * PER * ROUNDS)
+
+static const int level[LEVELS] = {10, 30, 20};
+static int log_prio[RUNS], log_id[RUNS];
+static int nlog;
+static int urgent_done;
+
+static int worker(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    for (int i = 0; i < ROUNDS; i++) {
+        log_prio[nlog] = level[id / PER];
+        log_id[nlog++] = id;
+        lwp_yield();
+    }
+    return 0;
+}
+
+static int urgent(void *arg)
+{
+    (void)arg;
+    urgent_done = 1;
+    return 0;
+}
+
+static int creator(void *arg)
+{
+    (void)arg;
+    tid_t t = lwp_create(urgent, NULL);
+    CHECK(lwp_set_priority(t, LWP_PRIO_MAX) == 0);
+    CHECK(!urgent_done);
+    lwp_yield();
+    CHECK(urgent_done);
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_prio");
+    lwp_set_scheduler(&prio_vtable);
+    lwp_start();
+    CHECK(lwp_set_priority(lwp_gettid(), LWP_PRIO_MAX + 1) == -1);
+    CHECK(lwp_set_priority(NO_THREAD, LWP_PRIO_DEFAULT) == -1);
+
+    /* All below main, so none runs before main waits */
+    for (intptr_t i = 0; i < LEVELS * PER; i++) {
+        tid_t t = lwp_create(worker, (void *)i);
+        CHECK(lwp_set_priority(t, level[i / PER]) == 0);
+    }
+    for (int i = 0; i < LEVELS * PER; i++)
+        lwp_wait(NULL);
+
+    CHECK(nlog == RUNS);
+    for (int i = 1; i < RUNS; i++) {
+        CHECK(log_prio[i] <= log_prio[i - 1]);
+        /* Round robin within a level */
+        if (log_prio[i] == log_prio[i - 1])
+            CHECK(log_id[i] != log_id[i - 1]);
+    }
+    CHECK(log_prio[0] == 30 && log_prio[RUNS - 1] == 10);
+
+    tid_t c = lwp_create(creator, NULL);
+    CHECK(lwp_set_priority(c, LWP_PRIO_MIN) == 0);
+    lwp_wait(NULL);
+    lwp_wait(NULL);
+    CHECK(urgent_done);
+
+    return test_done();
+}
@@ -0,0 +1,174 @@
+/* Shared stacks: LWPs recurse with locals on two shared stacks while
+ * yielding, sleeping, passing values over a channel and being
+ * preempted, so their frames keep getting copied out and back. Then
+ * LWPs that get switched out inside coroutines, whose saved rsp is
+ * on the coroutine's stack rather than the shared one, and ones that
+ * only resume and yield, so ticks land between the two halves.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+#include <string.h>
+
+#define THREADS 64
+#define DEPTH   40
+#define CORO_THREADS 8
+#define COUNT   100
+#define SPINS   200000
+
+static lwp_chan *ch;
+static long results[THREADS];
+
+static long recurse(int id, int d)
+{
+    char buf[32 + (id % 5) * 24];
+    memset(buf, id + d, sizeof(buf));
+    if (d % 3 == 0)
+        lwp_yield();
+    if (d == DEPTH / 2)
+        lwp_sleep(50000);
+    long below = d ? recurse(id, d - 1) : 0;
+    long sum = 0;
+    for (size_t i = 0; i < sizeof(buf); i++)
+        sum += (signed char)buf[i];
+    return sum + below;
+}
+
+static long expected(int id)
+{
+    long sum = 0;
+    for (int d = 0; d <= DEPTH; d++)
+        sum += (long)(32 + (id % 5) * 24) * (signed char)(id + d);
+    return sum;
+}
+
+static int worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    long local = id;
+    results[id] = recurse(id, DEPTH);
+    /* Our locals are where we left them after all that */
+    CHECK(local == id);
+    CHECK(lwp_chan_send(ch, (void *)(intptr_t)id) == 0);
+    return 0;
+}
+
+/* Yields the LWP while running, then the next number */
+static void *counter(void *arg)
+{
+    (void)arg;
+    for (intptr_t i = 1; ; i++) {
+        lwp_yield();
+        lwp_coro_yield((void *)i);
+    }
+    return NULL;
+}
+
+/* Runs a counter of its own, so two coroutines are running at once */
+static void *nested(void *arg)
+{
+    lwp_coro *inner = lwp_coro_create(counter, arg, 0);
+    for (;;)
+        lwp_coro_yield(lwp_coro_resume(inner, NULL));
+    return NULL;
+}
+
+/* The next number, without ever yielding the LWP */
+static void *ticker(void *arg)
+{
+    (void)arg;
+    for (intptr_t i = 1; ; i++)
+        lwp_coro_yield((void *)i);
+    return NULL;
+}
+
+static int spin_worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    char mark[200];
+    memset(mark, id, sizeof(mark));
+
+    lwp_coro *co = lwp_coro_create(ticker, NULL, 0);
+    long sum = 0;
+    for (int i = 0; i < SPINS; i++)
+        sum += (long)(intptr_t)lwp_coro_resume(co, NULL);
+    CHECK(sum == (long)SPINS * (SPINS + 1) / 2);
+    for (size_t i = 0; i < sizeof(mark); i++)
+        CHECK(mark[i] == (char)id);
+    lwp_coro_destroy(co);
+    return 0;
+}
+
+static int coro_worker(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    char mark[200];
+    memset(mark, id, sizeof(mark));
+
+    lwp_coro *co = lwp_coro_create(id & 1 ? nested : counter, NULL, 0);
+    long sum = 0;
+    for (int i = 0; i < COUNT; i++)
+        sum += (long)(intptr_t)lwp_coro_resume(co, NULL);
+    CHECK(sum == (long)COUNT * (COUNT + 1) / 2);
+    for (size_t i = 0; i < sizeof(mark); i++)
+        CHECK(mark[i] == (char)id);
+    lwp_coro_destroy(co);
+    return 0;
+}
+
+int main(void)
+{
+    lwp_shstack *st[2];
+    lwp_attr attr;
+
+    test_begin("t_shstk");
+    lwp_set_preempt(100);
+    ch = lwp_chan_create(0);
+    for (int i = 0; i < 2; i++) {
+        st[i] = lwp_shstack_create(256 * 1024);
+        CHECK(st[i] != NULL);
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    for (int i = 0; i < THREADS; i++) {
+        attr.shared = st[i % 2];
+        CHECK(lwp_create_ex(worker, (void *)(intptr_t)i, &attr) != NO_THREAD);
+    }
+    CHECK(lwp_set_workers(2) == -1);        /* 1:1 only */
+    lwp_start();
+
+    long ids = 0;
+    for (int i = 0; i < THREADS; i++) {
+        void *v;
+        CHECK(lwp_chan_recv(ch, &v) == 0);
+        ids += (long)(intptr_t)v;
+    }
+    CHECK(ids == (long)THREADS * (THREADS - 1) / 2);
+    CHECK(lwp_shstack_destroy(st[0]) == -1);    /* not reaped yet */
+    for (int i = 0; i < THREADS; i++)
+        lwp_wait(NULL);
+    for (int i = 0; i < THREADS; i++)
+        CHECK(results[i] == expected(i));
+
+    for (int i = 0; i < CORO_THREADS; i++) {
+        attr.shared = st[0];
+        CHECK(lwp_create_ex(coro_worker, (void *)(intptr_t)i, &attr)
+              != NO_THREAD);
+    }
+    for (int i = 0; i < CORO_THREADS; i++)
+        lwp_wait(NULL);
+
+    lwp_set_preempt(20);
+    for (int i = 0; i < CORO_THREADS; i++) {
+        attr.shared = st[i % 2];
+        CHECK(lwp_create_ex(spin_worker, (void *)(intptr_t)i, &attr)
+              != NO_THREAD);
+    }
+    for (int i = 0; i < CORO_THREADS; i++)
+        lwp_wait(NULL);
+    for (int i = 0; i < 2; i++)
+        CHECK(lwp_shstack_destroy(st[i]) == 0);
+    lwp_chan_destroy(ch);
+
+    return test_done();
+}
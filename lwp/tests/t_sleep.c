@@ -0,0 +1,62 @@
+/* Timers: LWPs that sleep for different times, created in shuffled
+ * order, wake shortest first and never early, while a busy LWP keeps
+ * the worker from going idle.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+
+#define SLEEPERS 8
+#define STEP_NS  (5 * 1000 * 1000ULL)
+
+static const int order[SLEEPERS] = {5, 2, 7, 0, 3, 6, 1, 4};
+static int woke[SLEEPERS];
+static int nwoke;
+
+static int sleeper(void *arg)
+{
+    intptr_t slot = (intptr_t)arg;
+    unsigned long long want = (slot + 1) * STEP_NS;
+    unsigned long long start = lwp_now();
+
+    lwp_sleep(want);
+    CHECK(lwp_now() - start >= want);
+    woke[nwoke++] = slot;
+    return 0;
+}
+
+static int busy(void *arg)
+{
+    (void)arg;
+    while (nwoke < SLEEPERS)
+        lwp_yield();
+    return 0;
+}
+
+int main(void)
+{
+    test_begin("t_sleep");
+    lwp_start();
+
+    for (int round = 0; round < 2; round++) {
+        nwoke = 0;
+        for (int i = 0; i < SLEEPERS; i++)
+            lwp_create(sleeper, (void *)(intptr_t)order[i]);
+        /* First round spins through the busy path, second idles */
+        if (round == 0)
+            lwp_create(busy, NULL);
+        for (int i = 0; i < SLEEPERS + (round == 0); i++)
+            lwp_wait(NULL);
+        CHECK(nwoke == SLEEPERS);
+        for (int i = 0; i < SLEEPERS; i++)
+            CHECK(woke[i] == i);
+    }
+
+    /* Already past: returns straight away */
+    unsigned long long t = lwp_now();
+    lwp_sleep_until(t - STEP_NS);
+    lwp_sleep(0);
+    CHECK(lwp_now() - t < STEP_NS);
+
+    return test_done();
+}
@@ -0,0 +1,65 @@
+/* Stackless tasks: they run on the next yields, chains of them that
+ * run past one batch finish while LWPs keep yielding, and whatever is
+ * still queued when the last LWP exits runs before the process ends.
+ */
+#include "lwp.h"
+#include "check.h"
+#include <stdint.h>
+
+#define SPAWNS 40
+#define CHAIN  100
+
+static long ran;
+static long hops;
+
+static void count(void *arg)
+{
+    __atomic_add_fetch(&ran, (long)(intptr_t)arg, __ATOMIC_RELAXED);
+}
+
+static void hop(void *arg)
+{
+    intptr_t left = (intptr_t)arg;
+    hops++;
+    if (left > 1)
+        CHECK(lwp_spawn_task(hop, (void *)(left - 1)) == 0);
+}
+
+static int yielder(void *arg)
+{
+    (void)arg;
+    while (hops < CHAIN)
+        lwp_yield();
+    return 0;
+}
+
+/* Runs after the library's exit(), before check.h's guard */
+static void at_end(void)
+{
+    CHECK(hops == 2 * CHAIN);
+    _exit(test_done());
+}
+
+int main(void)
+{
+    test_begin("t_task");
+    atexit(at_end);
+    lwp_start();
+
+    for (intptr_t i = 1; i <= SPAWNS; i++)
+        CHECK(lwp_spawn_task(count, (void *)i) == 0);
+    CHECK(ran == 0);            /* nothing runs them before a yield */
+    for (int i = 0; i < SPAWNS && ran < SPAWNS * (SPAWNS + 1) / 2; i++)
+        lwp_yield();
+    CHECK(ran == SPAWNS * (SPAWNS + 1) / 2);
+
+    CHECK(lwp_spawn_task(hop, (void *)CHAIN) == 0);
+    lwp_create(yielder, NULL);
+    lwp_wait(NULL);
+    CHECK(hops == CHAIN);
+
+    /* The last LWP leaves with a chain still queued */
+    CHECK(lwp_spawn_task(hop, (void *)CHAIN) == 0);
+    lwp_exit(0);
+    return 1;
+}
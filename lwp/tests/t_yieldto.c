@@ -0,0 +1,55 @@
+/* lwp_yield_to() under round robin and fair share: a chain of
+ * handoffs runs in exactly the order asked for, whatever the run
+ * queue says, and a tid that can't be run just yields.
+ */
+#include "lwp.h"
+#include "schedulers.h"
+#include "check.h"
+#include <stdint.h>
+
+#define THREADS 4
+
+static const int hand_to[THREADS] = {3, 2, 0, 1};
+static tid_t tids[THREADS];
+static int order[2 * THREADS];
+static int norder;
+
+static int chain_link(void *arg)
+{
+    intptr_t id = (intptr_t)arg;
+    order[norder++] = id;
+    lwp_yield_to(tids[hand_to[id]]);
+    order[norder++] = id + THREADS;
+    return 0;
+}
+
+static void chain(void)
+{
+    norder = 0;
+    for (intptr_t i = 0; i < THREADS; i++)
+        tids[i] = lwp_create(chain_link, (void *)i);
+    lwp_yield_to(tids[2]);
+    for (int i = 0; i < THREADS; i++)
+        lwp_wait(NULL);
+
+    /* 2 hands to 0, 0 to 3, 3 to 1 and 1 back to 2 */
+    static const int want[] = {2, 0, 3, 1, 2 + THREADS};
+    CHECK(norder == 2 * THREADS);
+    for (int i = 0; i < (int)(sizeof(want) / sizeof(want[0])); i++)
+        CHECK(order[i] == want[i]);
+}
+
+int main(void)
+{
+    test_begin("t_yieldto");
+    lwp_start();
+
+    chain();
+    lwp_yield_to(lwp_gettid());
+    lwp_yield_to(NO_THREAD);
+
+    lwp_set_scheduler(&fair_vtable);
+    chain();
+
+    return test_done();
+}
@@ -0,0 +1,103 @@
+#include "wsdeque.h"
+#include <stddef.h>
+
+/*
+ * Orderings follow Le, Pop, Cohen & Zappa Nardelli, "Correct and
+ * Efficient Work-Stealing for Weak Memory Models" (PPoPP '13).
+ */
+
+#define MASK (WSDEQUE_CAP - 1)
+
+/**
+ * @brief Empties the deque
+ */
+void wsdeque_init(wsdeque *dq)
+{
+    atomic_store_explicit(&dq->top, 0, memory_order_relaxed);
+    atomic_store_explicit(&dq->bottom, 0, memory_order_relaxed);
+}
+
+/**
+ * @brief Pushes a thread on the bottom (owner only)
+ * @return 0, or -1 if the deque is full
+ */
+int wsdeque_push(wsdeque *dq, thread t)
+{
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&dq->top, memory_order_acquire);
+
+    if (b - top >= WSDEQUE_CAP)
+    {
+        return -1;
+    }
+    atomic_store_explicit(&dq->buf[b & MASK], t, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    return 0;
+}
+
+/**
+ * @brief Pops the most recently pushed thread (owner only)
+ * @return The thread, or NULL if empty or a thief got the last one
+ */
+thread wsdeque_pop(wsdeque *dq)
+{
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&dq->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long top = atomic_load_explicit(&dq->top, memory_order_relaxed);
+
+    if (top > b)
+    {
+        // Already empty
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    thread t = atomic_load_explicit(&dq->buf[b & MASK], memory_order_relaxed);
+    if (top == b)
+    {
+        // Last one, race any thief for it
+        if (!atomic_compare_exchange_strong_explicit(&dq->top, &top, top + 1,
+                    memory_order_seq_cst, memory_order_relaxed))
+        {
+            t = NULL;
+        }
+        atomic_store_explicit(&dq->bottom, b + 1, memory_order_relaxed);
+    }
+    return t;
+}
+
+/**
+ * @brief Takes the oldest thread from another worker's deque
+ * @return The thread, or NULL if empty or we lost a race
+ */
+thread wsdeque_steal(wsdeque *dq)
+{
+    long top = atomic_load_explicit(&dq->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&dq->bottom, memory_order_acquire);
+
+    if (top >= b)
+    {
+        return NULL;
+    }
+    thread t = atomic_load_explicit(&dq->buf[top & MASK], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&dq->top, &top, top + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+    {
+        return NULL;
+    }
+    return t;
+}
+
+/**
+ * @brief Rough number of threads in the deque; may be stale by the
+ * time it returns
+ */
+long wsdeque_size(wsdeque *dq)
+{
+    long b = atomic_load_explicit(&dq->bottom, memory_order_relaxed);
+    long top = atomic_load_explicit(&dq->top, memory_order_relaxed);
+    return b > top ? b - top : 0;
+}
@@ -0,0 +1,25 @@
+#ifndef WSDEQUEH
+#define WSDEQUEH
+
+#include <lwp.h>
+#include <stdatomic.h>
+
+/* Chase-Lev work-stealing deque of runnable threads.  The owning
+ * worker pushes and pops at the bottom; any other worker may steal
+ * from the top.  Fixed capacity: a full deque just refuses the push.
+ */
+#define WSDEQUE_CAP 1024        /* must be a power of two */
+
+typedef struct wsdeque {
+  _Atomic long    top;          /* next slot to steal      */
+  _Atomic long    bottom;       /* next slot to push       */
+  _Atomic(thread) buf[WSDEQUE_CAP];
+} wsdeque;
+
+void   wsdeque_init(wsdeque *dq);
+int    wsdeque_push(wsdeque *dq, thread t);  /* owner only, -1 if full */
+thread wsdeque_pop(wsdeque *dq);             /* owner only             */
+thread wsdeque_steal(wsdeque *dq);           /* any worker             */
+long   wsdeque_size(wsdeque *dq);            /* racy, for heuristics   */
+
+#endif
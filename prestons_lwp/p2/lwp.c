@@ -234,6 +234,7 @@ tid_t lwp_create(lwpfun function, void *argument, size_t stackhint) {
     new_lwp->state.fxsave = FPU_INIT;
     new_lwp->sched_two = NULL;
     new_lwp->sched_one = NULL;
+    new_lwp->exited = NULL;
     new_lwp->lib_one = NULL;
     new_lwp->lib_two = NULL;
 
@@ -356,7 +357,7 @@ void lwp_exit(int exit_status) {
     
     if (waiting_thread != NULL) {
         /* Hand off directly to waiter */
-        waiting_thread->sched_two = running_thread;
+        waiting_thread->exited = running_thread;
         if (active_scheduler && active_scheduler->admit) {
             active_scheduler->admit(waiting_thread);
         }
@@ -400,14 +401,14 @@ tid_t lwp_wait(int *exit_status) {
         active_scheduler->remove(running_thread);
     }
 
-    running_thread->sched_two = NULL;
+    running_thread->exited = NULL;
     enqueue_thread(&blocked_threads_head, 
  			&blocked_threads_tail, running_thread);
 
     lwp_yield();  /* Block here */
 
     /* Resumed after a thread exited */
-    dead_thread = running_thread->sched_two;
+    dead_thread = running_thread->exited;
     
     if (dead_thread != NULL) {
         tid_t dead_tid = dead_thread->tid;
@@ -423,7 +424,7 @@ tid_t lwp_wait(int *exit_status) {
             munmap(dead_thread->stack, dead_thread->stacksize);
         }
         free(dead_thread);
-        running_thread->sched_two = NULL;
+        running_thread->exited = NULL;
 
         return dead_tid;
     }
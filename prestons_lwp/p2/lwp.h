@@ -111,6 +111,7 @@ typedef struct threadinfo_st {
   thread        lib_two;        /* for use by the library  */
   thread        sched_one;      /* Two more for            */
   thread        sched_two;      /* schedulers to use       */
+  thread        exited;         /* and one for lwp_wait()  */
 } context;
 
 typedef int (*lwpfun)(void *);  /* type for lwp function */
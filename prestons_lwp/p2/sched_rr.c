@@ -3,8 +3,9 @@
 #include <stdio.h>
 #include <stddef.h>
 
-/* Macro for accessing scheduler-private link */
+/* Macros for accessing scheduler-private links */
 #define NEXT_IN_QUEUE(t) ((t)->sched_one)
+#define PREV_IN_QUEUE(t) ((t)->sched_two)
 
 /* Round-robin queue state */
 typedef struct {
@@ -34,6 +35,7 @@ static void rr_enqueue(thread t) {
     }
     
     NEXT_IN_QUEUE(t) = NULL;
+    PREV_IN_QUEUE(t) = ready_queue.back;
     
     if (ready_queue.back != NULL) {
         NEXT_IN_QUEUE(ready_queue.back) = t;
@@ -48,39 +50,33 @@ static void rr_enqueue(thread t) {
 
 /**
  *  * Remove specific thread from ready queue
+ *  * (doubly linked, so no search; no-op if not queued)
  *   */
 static void rr_dequeue(thread target) {
     if (target == NULL || ready_queue.front == NULL) {
         return;
     }
 
-    thread prev = NULL;
-    thread curr = ready_queue.front;
-
-    /* Search for target in queue */
-    while (curr != NULL) {
-        if (curr == target) {
-            /* Found it - unlink */
-            if (prev != NULL) {
-                NEXT_IN_QUEUE(prev) = NEXT_IN_QUEUE(curr);
-            } else {
-                /* Removing front */
-                ready_queue.front = NEXT_IN_QUEUE(curr);
-            }
-            
-            /* Update back pointer if needed */
-            if (ready_queue.back == curr) {
-                ready_queue.back = prev;
-            }
+    if (PREV_IN_QUEUE(target) != NULL) {
+        NEXT_IN_QUEUE(PREV_IN_QUEUE(target)) = NEXT_IN_QUEUE(target);
+    } else if (ready_queue.front == target) {
+        /* Removing front */
+        ready_queue.front = NEXT_IN_QUEUE(target);
+    } else {
+        /* Not in the queue */
+        return;
+    }
 
-            NEXT_IN_QUEUE(curr) = NULL;
-            ready_queue.count--;
-            return;
-        }
-        
-        prev = curr;
-        curr = NEXT_IN_QUEUE(curr);
+    /* Update back pointer if needed */
+    if (NEXT_IN_QUEUE(target) != NULL) {
+        PREV_IN_QUEUE(NEXT_IN_QUEUE(target)) = PREV_IN_QUEUE(target);
+    } else {
+        ready_queue.back = PREV_IN_QUEUE(target);
     }
+
+    NEXT_IN_QUEUE(target) = NULL;
+    PREV_IN_QUEUE(target) = NULL;
+    ready_queue.count--;
 }
 
 /**
@@ -97,7 +93,9 @@ static thread rr_select_next(void) {
     if (ready_queue.front != ready_queue.back) {
         thread rotating = ready_queue.front;
         ready_queue.front = NEXT_IN_QUEUE(rotating);
+        PREV_IN_QUEUE(ready_queue.front) = NULL;
         NEXT_IN_QUEUE(rotating) = NULL;
+        PREV_IN_QUEUE(rotating) = ready_queue.back;
         NEXT_IN_QUEUE(ready_queue.back) = rotating;
         ready_queue.back = rotating;
     }
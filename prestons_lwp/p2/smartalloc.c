@@ -38,26 +38,42 @@
 
 #define PATTERN 0xA
 #define MARGIN 16
-#define HASH_SIZE	113
-#define smartalloc_hash(x) ( ((unsigned long)(x)) % HASH_SIZE )
+
+/* Tracking records live inline in open-addressed (linear probing) tables.
+ * The address space is striped across SHARDS tables, each with its own
+ * lock, so threads freeing unrelated blocks rarely contend. A shard
+ * doubles once it passes 3/4 full, so probes stay short no matter how
+ * many blocks are live.
+ */
+#define SHARD_BITS 4
+#define SHARDS (1 << SHARD_BITS)
+#define SHARD_MIN 64
+#define smartalloc_hash(x) \
+   ((((unsigned long)(x)) >> 4) * 0x9E3779B97F4A7C15UL)
+#define smartalloc_shard(h) ((h) >> (sizeof(unsigned long) * 8 - SHARD_BITS))
+#define smartalloc_slot(h, cap) (((h) ^ ((h) >> 29)) & ((cap) - 1))
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-static pthread_mutex_t mutt = PTHREAD_MUTEX_INITIALIZER;
-
 typedef struct track_t {
    char *data;
    unsigned long space;
    unsigned char needs_free;
    unsigned short margin;
-   struct track_t *next;
 } track_t, *track_t_ptr;
 
-static track_t_ptr track_hash[HASH_SIZE];
+typedef struct shard_t {
+   pthread_mutex_t lock;
+   track_t *slots;
+   unsigned long cap;           /* always a power of two (or 0) */
+   unsigned long count;
+} shard_t;
+
+static shard_t shards[SHARDS];
 static unsigned long allocated = 0;
-static int inited = 0;
+static pthread_once_t inited = PTHREAD_ONCE_INIT;
 
 static void completion_function(void)
 {
@@ -67,31 +83,62 @@ static void completion_function(void)
 								 allocated);
 }
 
-void smartalloc_track(char *data, unsigned long space, 
-			unsigned char needs_free, unsigned short margin)
+static void smartalloc_init(void)
 {
-   track_t *temp;
+   int i;
 
-   if (inited == 0) {
-      atexit(completion_function);
-	  memset(track_hash, 0, sizeof(track_hash));
-	  inited = 1;
-   }
-   if ((temp = (track_t *) malloc(sizeof(track_t))) == NULL)
+   for (i = 0; i < SHARDS; i++)
+      pthread_mutex_init(&shards[i].lock, NULL);
+   atexit(completion_function);
+}
+
+/* Insert without growing; caller holds the shard lock */
+static void shard_place(shard_t *sh, const track_t *rec)
+{
+   unsigned long i = smartalloc_slot(smartalloc_hash(rec->data), sh->cap);
+
+   while (sh->slots[i].data != NULL)
+      i = (i + 1) & (sh->cap - 1);
+   sh->slots[i] = *rec;
+   sh->count++;
+}
+
+static void shard_grow(shard_t *sh)
+{
+   track_t *old = sh->slots;
+   unsigned long old_cap = sh->cap, i;
+
+   sh->cap = old_cap ? old_cap * 2 : SHARD_MIN;
+   if ((sh->slots = (track_t *) calloc(sh->cap, sizeof(track_t))) == NULL)
    {
       fprintf(stderr, "Malloc failure in in smartalloc\n");
       exit(1);
    }
+   sh->count = 0;
+   for (i = 0; i < old_cap; i++)
+      if (old[i].data != NULL)
+         shard_place(sh, &old[i]);
+   free(old);
+}
 
-   pthread_mutex_lock(&mutt);
-   allocated += space;
-   temp->needs_free = needs_free;
-   temp->data = data;
-   temp->space = space;
-   temp->margin = margin;
-   temp->next = track_hash[smartalloc_hash(data)];
-   track_hash[smartalloc_hash(data)] = temp;
-   pthread_mutex_unlock(&mutt);
+void smartalloc_track(char *data, unsigned long space, 
+			unsigned char needs_free, unsigned short margin)
+{
+   track_t rec;
+   shard_t *sh = &shards[smartalloc_shard(smartalloc_hash(data))];
+
+   pthread_once(&inited, smartalloc_init);
+   rec.data = data;
+   rec.space = space;
+   rec.needs_free = needs_free;
+   rec.margin = margin;
+
+   pthread_mutex_lock(&sh->lock);
+   if ((sh->count + 1) * 4 > sh->cap * 3)
+      shard_grow(sh);
+   shard_place(sh, &rec);
+   pthread_mutex_unlock(&sh->lock);
+   __atomic_fetch_add(&allocated, space, __ATOMIC_RELAXED);
 }
 
 void *smartalloc(unsigned long bytes, char *file, int line, char fill)
@@ -130,34 +177,43 @@ void *smartvalloc(unsigned long bytes, char *file, int line, char fill)
    return data;
 }
 
-track_t *removeTrackNode(void *address)
+/* Copies the record for address into *out and drops it from the table.
+ * Returns 0 if address isn't tracked.
+ */
+int removeTrackNode(void *address, track_t *out)
 {
-   track_t *temp, *to_free;
-
-   if (track_hash[smartalloc_hash(address)] == NULL)
-      return NULL;
+   shard_t *sh = &shards[smartalloc_shard(smartalloc_hash(address))];
+   unsigned long i, j, home;
 
-   pthread_mutex_lock(&mutt);
-   if (track_hash[smartalloc_hash(address)]->data == address) {
-      to_free = track_hash[smartalloc_hash(address)];
-      track_hash[smartalloc_hash(address)] = 
-			track_hash[smartalloc_hash(address)]->next;
-   } 
-   else {
-      for (temp = track_hash[smartalloc_hash(address)]; 
-		temp->next != NULL && temp->next->data != address;)
-         temp = temp->next;
-      if (temp->next == NULL) {
-		   pthread_mutex_unlock(&mutt);
-         return NULL;
+   pthread_mutex_lock(&sh->lock);
+   if (sh->cap == 0) {
+      pthread_mutex_unlock(&sh->lock);
+      return 0;
+   }
+   for (i = smartalloc_slot(smartalloc_hash(address), sh->cap);
+		sh->slots[i].data != address; i = (i + 1) & (sh->cap - 1))
+      if (sh->slots[i].data == NULL) {
+         pthread_mutex_unlock(&sh->lock);
+         return 0;
+      }
+   *out = sh->slots[i];
+
+   /* Backward-shift delete: pull later entries of the cluster into the
+    * hole unless that would move them in front of their home slot. */
+   for (j = (i + 1) & (sh->cap - 1); sh->slots[j].data != NULL;
+		j = (j + 1) & (sh->cap - 1)) {
+      home = smartalloc_slot(smartalloc_hash(sh->slots[j].data), sh->cap);
+      if (((j - home) & (sh->cap - 1)) >= ((j - i) & (sh->cap - 1))) {
+         sh->slots[i] = sh->slots[j];
+         i = j;
       }
-      to_free = temp->next;
-      temp->next = to_free->next;
    }
-   allocated -= to_free->space;
-   pthread_mutex_unlock(&mutt);
+   sh->slots[i].data = NULL;
+   sh->count--;
+   pthread_mutex_unlock(&sh->lock);
+   __atomic_fetch_sub(&allocated, out->space, __ATOMIC_RELAXED);
 
-   return to_free;
+   return 1;
 }
 
 void freechecks(track_t *check, char *file, int line)
@@ -176,27 +232,24 @@ void freechecks(track_t *check, char *file, int line)
 
 void smartfree(void *address, char *file, int line)
 {
-   track_t *to_free;
+   track_t to_free;
 
-   to_free = removeTrackNode(address);
-   if (NULL == to_free) {
+   if (!removeTrackNode(address, &to_free)) {
       fprintf(stderr, 
        "Attempt to free non-malloced space in file %s at line %d\n",
        file, line);
       return;
    }
 
-   freechecks(to_free, file, line);
-   if (to_free->needs_free)
-      free(to_free->data - to_free->margin);
-
-   free(to_free);
+   freechecks(&to_free, file, line);
+   if (to_free.needs_free)
+      free(to_free.data - to_free.margin);
 }
 
 void* smartrealloc(void* ptr, unsigned long newSize, int freeOnFailure,
       char *file, int line, char fill)
 {
-   track_t *to_free;
+   track_t to_free;
    int limit;
    void *newMem;
    char *s, *d;
@@ -204,8 +257,7 @@ void* smartrealloc(void* ptr, unsigned long newSize, int freeOnFailure,
    if (!ptr)
       return smartalloc(newSize, file, line, fill);
 
-   to_free = removeTrackNode(ptr);
-   if (NULL == to_free) {
+   if (!removeTrackNode(ptr, &to_free)) {
       fprintf(stderr, 
        "Attempt to free non-malloced space in file %s at line %d\n",
        file, line);
@@ -215,33 +267,31 @@ void* smartrealloc(void* ptr, unsigned long newSize, int freeOnFailure,
    newMem = smartalloc(newSize, file, line, fill);
    if (NULL == newMem) {
       if (freeOnFailure) {
-         freechecks(to_free, file, line);
-         if (to_free->needs_free)
-            free(to_free->data - to_free->margin);
+         freechecks(&to_free, file, line);
+         if (to_free.needs_free)
+            free(to_free.data - to_free.margin);
       }
       else
-         smartalloc_track(ptr, to_free->space, to_free->needs_free, MARGIN);
+         smartalloc_track(ptr, to_free.space, to_free.needs_free, MARGIN);
 
-      free(to_free);
       return NULL;
    }
 
-   limit = newSize < to_free->space ? newSize : to_free->space;
+   limit = newSize < to_free.space ? newSize : to_free.space;
    s = (char*)ptr;
    d = (char*)newMem;
    while (limit-- > 0)
       *d++ = *s++;
 
-   freechecks(to_free, file, line);
-   if (to_free->needs_free)
-      free(to_free->data - to_free->margin);
-   free(to_free);
+   freechecks(&to_free, file, line);
+   if (to_free.needs_free)
+      free(to_free.data - to_free.margin);
    return newMem;
 }
 
 unsigned long report_space()
 {
-   return allocated;
+   return __atomic_load_n(&allocated, __ATOMIC_RELAXED);
 }
 
 
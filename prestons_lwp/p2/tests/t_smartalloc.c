@@ -0,0 +1,41 @@
+// tests/t_smartalloc.c
+#include "smartalloc.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define NBLOCKS  20000
+#define NTHREADS 4
+
+static char *blocks[NTHREADS][NBLOCKS];
+
+static void *churn(void *arg) {
+    char **mine = (char **)arg;
+    for (int i = 0; i < NBLOCKS; i++) {
+        mine[i] = malloc(1 + (i % 97));
+    }
+    /* free in a scrambled order so table deletes hit every cluster shape */
+    for (int i = 0; i < NBLOCKS; i++) {
+        int j = (int)(((unsigned)i * 7919u) % NBLOCKS);
+        free(mine[j]);
+    }
+    return NULL;
+}
+
+int main(void){
+  pthread_t th[NTHREADS];
+
+  for (int i = 0; i < NTHREADS; i++)
+    pthread_create(&th[i], NULL, churn, blocks[i]);
+  for (int i = 0; i < NTHREADS; i++)
+    pthread_join(th[i], NULL);
+  printf("[smartalloc] after churn: %lu bytes outstanding\n", report_space());
+
+  char *p = malloc(10);
+  p = realloc(p, 4000);
+  printf("[smartalloc] after realloc: %lu bytes outstanding\n", report_space());
+  free(p);
+  printf("[smartalloc] after free: %lu bytes outstanding\n", report_space());
+
+  return report_space() == 0 ? 0 : 1;
+}